@@ -1,17 +1,36 @@
+#define _GNU_SOURCE // copy_file_range
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* defines */
 
 #define EDI_VERSION "0.0.1"
@@ -19,6 +38,38 @@
 #define CTRL_KEY(k) ((k)&0x1f)
 #define EDI_QUIT_TIMES 2
 #define ENTER_KEY '\r'
+#define ROW_BLOCK_CAPACITY 64
+#define EDI_INPUT_BUFFER_SIZE 4096
+#define EDI_KEY_QUEUE_SIZE 1024
+#define EDI_FRAME_DEADLINE_MS 50 // longest time input may delay a redraw
+#define EDI_ESCAPE_TIMEOUT_MS 100
+#define EDI_MESSAGE_SECONDS 5
+#define EDI_AUTOSAVE_SECONDS 30
+#define EDI_POOL_MIN_SHIFT 4  // smallest size class is 16 bytes
+#define EDI_POOL_CLASSES 13   // up to 64 KiB, larger payloads use malloc
+#define EDI_SLAB_SIZE (256 * 1024)
+#define EDI_ARENA_CHUNK_SIZE (4 * 1024 * 1024)
+#define EDI_SAVE_IOVECS 512
+#define EDI_SEARCH_SPAN (64 * 1024) // bytes scanned in one batch
+#define EDI_INCREMENTAL_ROWS 65536 // rows search as you type scans per frame
+#define EDI_REGEX_GROUPS 10 // the whole match and groups 1 to 9
+#define EDI_DFA_STATES 1024 // cached DFA states before the cache is dropped
+#define EDI_FIND_THREADS 16
+#define EDI_FIND_CHUNK_BLOCKS 256 // blocks handed to a find all worker at once
+#define EDI_LOAD_THREADS 16
+#define EDI_LOAD_SLICE_MIN (16 * 1024 * 1024) // smaller ranges use one thread
+#define EDI_LOAD_FIRST_SIZE (64 * 1024) // loaded before the first frame
+#define EDI_LOAD_BATCH_SIZE (128 * 1024 * 1024)
+#define EDI_INDEX_CACHE_MIN (32 * 1024 * 1024) // smaller files are rescanned
+#define EDI_INDEX_CHECK_SIZE (64 * 1024) // bytes hashed at each end
+#define EDI_FOLLOW_CHUNK (64 * 1024) // appended bytes read at once
+#define EDI_SAVE_COPY_MIN (64 * 1024) // shorter runs are cheaper to writev
+#define EDI_RENDER_BUDGET (8 * 1024 * 1024) // bytes of cached render rows
+#define EDI_LONG_ROW_SIZE (64 * 1024) // longer rows render only what is seen
+#define EDI_COLUMN_SPAN 4096 // chars between column map checkpoints
+#define HL_UNKNOWN 0xff // lexer state of rows that were not lexed yet
+#define EDI_PAGE_BUDGET (64 * 1024 * 1024) // bytes of resident row blocks
+#define EDI_PAGE_KEEP 64 // blocks touched by the latest page ins stay
 
 enum editor_keys {
   BACKSPACE = 127,
@@ -30,17 +81,79 @@ enum editor_keys {
   HOME_KEY,
   END_KEY,
   PAGE_UP,
-  PAGE_DOWN
+  PAGE_DOWN,
+  PASTE_KEY // bracketed paste, the text waits in EDITOR.paste
 };
 /* global data */
 
+// long rows render only the columns on screen, the render column before
+// every EDI_COLUMN_SPAN chars is kept so that chars and columns map onto each
+// other by walking at most one span
+typedef struct column_map {
+  int valid; // leading checkpoints that are current, edits cut this back
+  int capacity;
+  int render_start, render_width; // the columns render holds, start -1: none
+  int at[]; // the render column before char i * EDI_COLUMN_SPAN
+} column_map;
+
+// owned rows keep their chars in a gap buffer: the text is chars[0, gap)
+// followed by the last size - gap bytes of the capacity, so repeated edits at
+// the same spot only move the gap, mapped rows have no gap and no capacity
 typedef struct editor_row {
   int size;
+  int capacity;
+  int gap;
   int render_size;
-  char *chars;
-  char *render;
+  int render_capacity;
+  int render_tabs; // tabs in the row while render is current
+  char *chars; // view into EDITOR.file_map while mapped, not NUL terminated
+  char *render; // built on demand, stale while render_dirty is set
+  column_map *columns; // rows of at least EDI_LONG_ROW_SIZE chars only
+  bool render_dirty;
+  bool render_ascii; // one byte per column, else a width per byte follows
+  unsigned char render_entry; // lexer state the colors behind render start
+                              // from, HL_UNKNOWN while render is uncolored
+  unsigned char hl_state; // lexer state after the row
+  bool mapped;
+  bool in_arena; // chars were bump allocated while loading
 } editor_row;
 
+// the document is a randomized balanced tree of row blocks ordered by line,
+// every node knows how many lines and blocks live in its subtree
+typedef struct row_block {
+  struct row_block *left, *right, *parent;
+  int lines;
+  int blocks;
+  int size; // rows held by this block
+  editor_row *rows; // NULL while paged out
+
+  // the bytes of the file the rows are split from when paged in, NULL for
+  // blocks that never were a run of file lines
+  const char *page_start, *page_end;
+  uint64_t page_hash; // of the bytes when their lines were counted
+  bool page_unchecked; // line count read from a sidecar, not yet verified
+
+  // blocks holding render rows, least recently drawn at the tail
+  struct row_block *lru_prev, *lru_next;
+  bool in_render_lru;
+  unsigned int render_frame;
+
+  // resident blocks, least recently touched at the tail
+  struct row_block *page_prev, *page_next;
+  bool in_page_lru;
+  unsigned long page_used; // page_clock at the last touch
+
+  // lexer states entering and leaving the block, they hold while it keeps
+  // the rows it had when it was lexed
+  unsigned char hl_start, hl_end;
+  bool hl_current;
+} row_block;
+
+typedef struct row_iterator {
+  row_block *block;
+  int index;
+} row_iterator;
+
 struct editor_config {
   int cursor_x, cursor_y;
   int render_cursor_x;
@@ -48,18 +161,114 @@ struct editor_config {
   int row_offset;
   int col_offset;
 
+  struct syntax *syntax; // NULL leaves the text uncolored
+  int highlight_frontier; // rows before it carry current lexer states
+
   char status_message[80];
   time_t status_message_time;
+  char prompt_note[64]; // shown after the open prompt, set by its callback
   char *filename;
   bool file_modified;
   int number_of_rows;
-  editor_row *row;
+  row_block *rows;
+
+  row_block *render_lru_head, *render_lru_tail;
+  size_t render_bytes;
+  unsigned int frame;
+
+  // blocks of a mapped file are paged in on first touch and paged out again
+  // while over EDI_PAGE_BUDGET if their rows still match the file
+  row_block *page_lru_head, *page_lru_tail;
+  size_t page_bytes;
+  unsigned long page_clock; // page ins so far
+  bool pages_pinned; // a find all scan reads the resident rows
+
+  // last frame sent to the terminal, one entry per screen line including the
+  // status and message bars, len -1 marks a line with unknown contents
+  struct append_buffer *shadow;
+  int shadow_lines;
+  int shadow_row_offset; // row_offset the shadow text lines were drawn at
+  int frame_bytes; // bytes written for the last frame
+  long long total_bytes_written;
+
+  char *file_map; // read only mapping of the opened file backing mapped rows
+  size_t file_map_size;
+  int file_fd;
+
+  // raw bytes read from stdin and the keys decoded from them, both rings
+  unsigned char input[EDI_INPUT_BUFFER_SIZE];
+  int input_start, input_length;
+  int keys[EDI_KEY_QUEUE_SIZE];
+  int key_start, key_count;
+
+  // text between the bracketed paste markers, decoding pauses while a
+  // finished paste waits for PASTE_KEY to be processed
+  char *paste;
+  int paste_length, paste_capacity;
+  bool pasting, paste_ready;
+
+  // the event loop waits on stdin, SIGWINCH and one timer that is armed for
+  // the next of the message expiry and autosave deadlines
+  int signal_fd, timer_fd;
+  time_t autosave_deadline;
 
   struct termios original_terminal_state;
 };
 
 struct editor_config EDITOR;
 
+// row payloads (chars and render) come from power of two size class pools,
+// a bulk load bump allocates from arena chunks that are dropped as a whole
+// once every row in them has been edited or freed
+typedef struct pool_free_chunk {
+  struct pool_free_chunk *next;
+} pool_free_chunk;
+
+struct row_allocator {
+  pool_free_chunk *free_list[EDI_POOL_CLASSES];
+  char *slab[EDI_POOL_CLASSES];
+  size_t slab_left[EDI_POOL_CLASSES];
+  size_t reserved[EDI_POOL_CLASSES];
+  size_t in_use[EDI_POOL_CLASSES];
+
+  char **arena_chunks;
+  int arena_chunk_count;
+  char *arena_top;
+  size_t arena_left;
+  size_t arena_reserved, arena_live;
+
+  size_t large_count, large_bytes;
+  long long allocations;
+};
+
+struct row_allocator ALLOCATOR;
+
+// --replay feeds a recorded key script to the editor at a fixed screen size
+// with the output going to /dev/null, every key is timed from the moment it
+// is read until the editor asks for the next one
+struct replay_state {
+  bool active;
+  int rows, cols;
+  FILE *report;
+  long long *latencies; // nanoseconds per key
+  int count, capacity;
+  bool timing; // a key was handed out and is being processed
+  struct timespec key_start, start;
+  double open_seconds;
+  long long start_allocations;
+} REPLAY;
+
+// hot path counters, the frame fields describe the last refresh_screen and
+// Ctrl-O shows them in an overlay below the message bar, with EDI_PERF_LOG
+// set everything is written to that file on exit
+struct perf_state {
+  bool overlay;
+  long long scroll_ns, draw_ns, write_ns; // last frame
+  long long frame_render_updates;
+  long long scroll_total_ns, draw_total_ns, write_total_ns;
+  long long frames, keys, reads, render_updates;
+} PERF;
+
 /*  prototypes */
 struct append_buffer;
 
@@ -67,7 +276,18 @@ int read_keypress();
 void append_buffer_append();
 void set_status_message(const char *fmt, ...);
 void refresh_screen();
-char *editor_prompt(char *prompt);
+void invalidate_frame();
+char *editor_prompt(char *prompt, void (*callback)(char *, int),
+                    bool allow_empty);
+void find_all_discard();
+void find_all_wait();
+void free_render_row(editor_row *row);
+void follow_saved(size_t length);
+void init_mapped_row(editor_row *row, char *line, size_t line_length);
+void page_check(row_block *block);
+void page_recount(row_block *block);
+void toggle_perf_overlay();
+void highlight_render_row(row_block *block, editor_row *row);
 
 /* terminal configuration */
 
@@ -108,6 +328,7 @@ void die(const char *s) {
 }
 
 void disable_raw_mode() {
+  write(STDOUT_FILENO, "\x1b[?2004l", 8); // bracketed paste off
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &EDITOR.original_terminal_state) ==
       -1) {
     die("tcsetattr");
@@ -125,10 +346,11 @@ void enable_raw_mode() {
   raw.c_oflag &= ~(OPOST);
   raw.c_cflag |= (CS8);
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
-  raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VMIN] = 0; // reads never block, the event loop polls first
+  raw.c_cc[VTIME] = 0;
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+  write(STDOUT_FILENO, "\x1b[?2004h", 8); // bracketed paste on
 }
 
 int get_cursor_position(int *rows, int *cols) {
@@ -137,8 +359,10 @@ int get_cursor_position(int *rows, int *cols) {
 
   char buffer[32];
   unsigned int i = 0;
+  struct pollfd stdin_poll = {STDIN_FILENO, POLLIN, 0};
   while (i < sizeof(buffer) - 1) {
-    if (read(STDIN_FILENO, &buffer[i], 1) != 1)
+    if (poll(&stdin_poll, 1, 1000) != 1 ||
+        read(STDIN_FILENO, &buffer[i], 1) != 1)
       break;
     if (buffer[i] == 'R')
       break;
@@ -157,6 +381,12 @@ int get_cursor_position(int *rows, int *cols) {
 int get_window_size(int *rows, int *cols) {
   struct winsize ws;
 
+  if (REPLAY.active) {
+    *rows = REPLAY.rows;
+    *cols = REPLAY.cols;
+    return 0;
+  }
+
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
     if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12)
       return -1;
@@ -168,263 +398,4369 @@ int get_window_size(int *rows, int *cols) {
   }
 }
 
-/* row operations */
-int cursor_x_to_render_x(editor_row *row, int cursor_x) {
-  int render_cursor_x = 0;
-  for (int i = 0; i < cursor_x; i++) {
-    if (row->chars[i] == '\t') {
-      render_cursor_x += (EDI_TAB_STOP - 1) - (render_cursor_x % EDI_TAB_STOP);
-    }
-    render_cursor_x++;
+// the text area is what the window leaves to the status and message bars
+// and the perf overlay
+void update_window_size() {
+  if (get_window_size(&EDITOR.screen_rows, &EDITOR.screen_cols) == -1)
+    die("get_window_size");
+  EDITOR.screen_rows -= PERF.overlay ? 3 : 2;
+}
+
+/* row allocator */
+
+int pool_class(int size) {
+  int size_class = 0;
+  while ((1 << (size_class + EDI_POOL_MIN_SHIFT)) < size)
+    size_class++;
+  return size_class;
+}
+
+// the capacity a payload of size bytes really gets
+int pool_capacity(int size) {
+  int size_class = pool_class(size);
+  return size_class < EDI_POOL_CLASSES ? 1 << (size_class + EDI_POOL_MIN_SHIFT)
+                                       : size;
+}
+
+void *pool_alloc(int capacity) {
+  ALLOCATOR.allocations++;
+  int size_class = pool_class(capacity);
+  if (size_class >= EDI_POOL_CLASSES) {
+    ALLOCATOR.large_count++;
+    ALLOCATOR.large_bytes += capacity;
+    return malloc(capacity);
+  }
+
+  ALLOCATOR.in_use[size_class] += capacity;
+  pool_free_chunk *chunk = ALLOCATOR.free_list[size_class];
+  if (chunk) {
+    ALLOCATOR.free_list[size_class] = chunk->next;
+    return chunk;
   }
 
-  return render_cursor_x;
+  if (ALLOCATOR.slab_left[size_class] < (size_t)capacity) {
+    ALLOCATOR.slab[size_class] = malloc(EDI_SLAB_SIZE);
+    ALLOCATOR.slab_left[size_class] = EDI_SLAB_SIZE;
+    ALLOCATOR.reserved[size_class] += EDI_SLAB_SIZE;
+  }
+  void *p = ALLOCATOR.slab[size_class];
+  ALLOCATOR.slab[size_class] += capacity;
+  ALLOCATOR.slab_left[size_class] -= capacity;
+  return p;
 }
 
-void update_render_row(editor_row *row) {
-  int tabs = 0;
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t')
-      tabs++;
+void pool_free(void *p, int capacity) {
+  if (p == NULL)
+    return;
+  int size_class = pool_class(capacity);
+  if (size_class >= EDI_POOL_CLASSES) {
+    ALLOCATOR.large_count--;
+    ALLOCATOR.large_bytes -= capacity;
+    free(p);
+    return;
   }
 
-  free(row->render);
-  row->render = malloc((row->size) + (tabs * (EDI_TAB_STOP - 1)) + 1);
-  int idx = 0;
+  ALLOCATOR.in_use[size_class] -= capacity;
+  pool_free_chunk *chunk = p;
+  chunk->next = ALLOCATOR.free_list[size_class];
+  ALLOCATOR.free_list[size_class] = chunk;
+}
 
-  for (int j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % EDI_TAB_STOP != 0)
-        row->render[idx++] = ' ';
+void *arena_alloc(int size) {
+  ALLOCATOR.allocations++;
+  if (ALLOCATOR.arena_left < (size_t)size) {
+    size_t chunk_size =
+        size > EDI_ARENA_CHUNK_SIZE ? (size_t)size : EDI_ARENA_CHUNK_SIZE;
+    ALLOCATOR.arena_chunks =
+        realloc(ALLOCATOR.arena_chunks,
+                sizeof(char *) * (ALLOCATOR.arena_chunk_count + 1));
+    ALLOCATOR.arena_top = malloc(chunk_size);
+    ALLOCATOR.arena_chunks[ALLOCATOR.arena_chunk_count++] = ALLOCATOR.arena_top;
+    ALLOCATOR.arena_left = chunk_size;
+    ALLOCATOR.arena_reserved += chunk_size;
+  }
+
+  void *p = ALLOCATOR.arena_top;
+  ALLOCATOR.arena_top += size;
+  ALLOCATOR.arena_left -= size;
+  ALLOCATOR.arena_live += size;
+  return p;
+}
+
+void arena_release(int size) {
+  ALLOCATOR.arena_live -= size;
+  if (ALLOCATOR.arena_live > 0)
+    return;
+
+  for (int i = 0; i < ALLOCATOR.arena_chunk_count; i++)
+    free(ALLOCATOR.arena_chunks[i]);
+  free(ALLOCATOR.arena_chunks);
+  ALLOCATOR.arena_chunks = NULL;
+  ALLOCATOR.arena_chunk_count = 0;
+  ALLOCATOR.arena_top = NULL;
+  ALLOCATOR.arena_left = 0;
+  ALLOCATOR.arena_reserved = 0;
+}
+
+// one line summary: pool bytes in use of reserved, the idle share is what
+// fragmentation costs, then arena and large allocations
+int format_allocator_stats(char *buffer, size_t length) {
+  size_t reserved = 0, in_use = 0;
+  for (int size_class = 0; size_class < EDI_POOL_CLASSES; size_class++) {
+    reserved += ALLOCATOR.reserved[size_class];
+    in_use += ALLOCATOR.in_use[size_class];
+  }
+  int idle = reserved ? (int)((reserved - in_use) * 100 / reserved) : 0;
+
+  return snprintf(buffer, length,
+                  "pools %zuK/%zuK (%d%% idle) arena %zuK/%zuK large %zu "
+                  "(%zuK) allocs %lld",
+                  in_use / 1024, reserved / 1024, idle,
+                  ALLOCATOR.arena_live / 1024, ALLOCATOR.arena_reserved / 1024,
+                  ALLOCATOR.large_count, ALLOCATOR.large_bytes / 1024,
+                  ALLOCATOR.allocations);
+}
+
+// bytes handed out for row chars and render rows, mapped rows hold none
+size_t row_payload_bytes() {
+  size_t in_use = ALLOCATOR.arena_live + ALLOCATOR.large_bytes;
+  for (int size_class = 0; size_class < EDI_POOL_CLASSES; size_class++)
+    in_use += ALLOCATOR.in_use[size_class];
+  return in_use;
+}
+
+/* row tree */
+
+int block_lines(row_block *block) { return block ? block->lines : 0; }
+
+int block_count(row_block *block) { return block ? block->blocks : 0; }
+
+void row_block_update(row_block *block) {
+  block->lines = block_lines(block->left) + block->size +
+                 block_lines(block->right);
+  block->blocks = block_count(block->left) + 1 + block_count(block->right);
+  if (block->left)
+    block->left->parent = block;
+  if (block->right)
+    block->right->parent = block;
+}
+
+// joining two random trees picks the root proportional to their sizes, which
+// keeps the result a random tree and the depth logarithmic
+row_block *row_block_merge(row_block *a, row_block *b) {
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (rand() % (a->blocks + b->blocks) < a->blocks) {
+    a->right = row_block_merge(a->right, b);
+    row_block_update(a);
+    return a;
+  }
+  b->left = row_block_merge(a, b->left);
+  row_block_update(b);
+  return b;
+}
+
+// split off the first count blocks into *left
+void row_block_split(row_block *block, int count, row_block **left,
+                     row_block **right) {
+  if (block == NULL) {
+    *left = *right = NULL;
+    return;
+  }
+
+  if (block_count(block->left) < count) {
+    row_block_split(block->right, count - block_count(block->left) - 1,
+                    &block->right, right);
+    row_block_update(block);
+    *left = block;
+  } else {
+    row_block_split(block->left, count, left, &block->left);
+    row_block_update(block);
+    *right = block;
+  }
+  if (*left)
+    (*left)->parent = NULL;
+  if (*right)
+    (*right)->parent = NULL;
+}
+
+row_block *row_block_build(row_block **blocks, int count) {
+  if (count == 0)
+    return NULL;
+
+  int middle = count / 2;
+  row_block *block = blocks[middle];
+  block->left = row_block_build(blocks, middle);
+  block->right = row_block_build(&blocks[middle + 1], count - middle - 1);
+  block->parent = NULL;
+  row_block_update(block);
+  return block;
+}
+
+int row_block_position(row_block *block) {
+  int position = block_count(block->left);
+  for (; block->parent; block = block->parent) {
+    if (block == block->parent->right)
+      position += block_count(block->parent->left) + 1;
+  }
+  return position;
+}
+
+void row_block_resize(row_block *block, int delta) {
+  block->size += delta;
+  block->hl_current = false;
+  for (; block; block = block->parent)
+    block->lines += delta;
+  EDITOR.number_of_rows += delta;
+}
+
+void render_lru_unlink(row_block *block) {
+  if (!block->in_render_lru)
+    return;
+  if (block->lru_prev)
+    block->lru_prev->lru_next = block->lru_next;
+  else
+    EDITOR.render_lru_head = block->lru_next;
+  if (block->lru_next)
+    block->lru_next->lru_prev = block->lru_prev;
+  else
+    EDITOR.render_lru_tail = block->lru_prev;
+  block->lru_prev = block->lru_next = NULL;
+  block->in_render_lru = false;
+}
+
+void render_lru_push_front(row_block *block) {
+  render_lru_unlink(block);
+  block->lru_next = EDITOR.render_lru_head;
+  if (EDITOR.render_lru_head)
+    EDITOR.render_lru_head->lru_prev = block;
+  else
+    EDITOR.render_lru_tail = block;
+  EDITOR.render_lru_head = block;
+  block->in_render_lru = true;
+}
+
+void page_lru_unlink(row_block *block) {
+  if (!block->in_page_lru)
+    return;
+  if (block->page_prev)
+    block->page_prev->page_next = block->page_next;
+  else
+    EDITOR.page_lru_head = block->page_next;
+  if (block->page_next)
+    block->page_next->page_prev = block->page_prev;
+  else
+    EDITOR.page_lru_tail = block->page_prev;
+  block->page_prev = block->page_next = NULL;
+  block->in_page_lru = false;
+}
+
+void page_lru_push_front(row_block *block) {
+  page_lru_unlink(block);
+  block->page_next = EDITOR.page_lru_head;
+  if (EDITOR.page_lru_head)
+    EDITOR.page_lru_head->page_prev = block;
+  else
+    EDITOR.page_lru_tail = block;
+  EDITOR.page_lru_head = block;
+  block->in_page_lru = true;
+}
+
+void page_alloc_rows(row_block *block) {
+  block->rows = calloc(ROW_BLOCK_CAPACITY, sizeof(editor_row));
+  if (block->rows == NULL)
+    die("calloc");
+  EDITOR.page_bytes += sizeof(editor_row) * ROW_BLOCK_CAPACITY;
+}
+
+// the end of the line starting at line in a page, a missing newline ends
+// the line at the end of the page
+const char *page_line_end(const char *line, const char *page_end) {
+  const char *newline = memchr(line, '\n', page_end - line);
+  return newline ? newline : page_end;
+}
+
+// a block can be paged out while paging it back in gives the same rows
+bool page_is_clean(row_block *block) {
+  if (block->page_start == NULL)
+    return false;
+  const char *line = block->page_start;
+  for (int j = 0; j < block->size; j++) {
+    editor_row *row = &block->rows[j];
+    if (!row->mapped || row->chars != line || line >= block->page_end)
+      return false;
+    const char *end = page_line_end(line, block->page_end);
+    int length = end - line;
+    while (length > 0 && line[length - 1] == ENTER_KEY)
+      length--;
+    if (row->size != length)
+      return false;
+    line = end + 1;
+  }
+  return line >= block->page_end;
+}
+
+void page_out(row_block *block) {
+  for (int j = 0; j < block->size; j++)
+    free_render_row(&block->rows[j]);
+  render_lru_unlink(block);
+  page_lru_unlink(block);
+  free(block->rows);
+  block->rows = NULL;
+  EDITOR.page_bytes -= sizeof(editor_row) * ROW_BLOCK_CAPACITY;
+}
+
+// a paged out block whose bytes are what a save writes for its rows, which
+// holds unless a line ends in a CR, which the save drops, or the last line
+// has no newline yet
+bool page_is_saved_as_is(row_block *block) {
+  size_t span = block->page_end - block->page_start;
+  return block->rows == NULL &&
+         (span == 0 || (block->page_end[-1] == '\n' &&
+                        memchr(block->page_start, '\r', span) == NULL));
+}
+
+// pages out clean blocks from the cold end, edited blocks leave the list
+// until they are touched again, and the blocks touched by the latest page
+// ins stay so that callers may hold on to a few row pointers
+void trim_pages() {
+  row_block *block = EDITOR.page_lru_tail;
+  while (EDITOR.page_bytes > EDI_PAGE_BUDGET && block &&
+         !EDITOR.pages_pinned &&
+         EDITOR.page_clock - block->page_used > EDI_PAGE_KEEP) {
+    row_block *previous = block->page_prev;
+    if (page_is_clean(block))
+      page_out(block);
+    else
+      page_lru_unlink(block);
+    block = previous;
+  }
+}
+
+// the rows of a block, split from its bytes in the file if it is paged out
+editor_row *page_in(row_block *block) {
+  if (block->rows == NULL) {
+    page_check(block);
+    page_alloc_rows(block);
+    const char *line = block->page_start;
+    for (int j = 0; j < block->size; j++) {
+      if (line >= block->page_end) {
+        // the page ran out of lines early, its count is wrong so count its
+        // lines again instead of making up empty rows
+        page_recount(block);
+        line = block->page_start;
+        j = -1;
+        continue;
+      }
+      const char *end = page_line_end(line, block->page_end);
+      init_mapped_row(&block->rows[j], (char *)line, end - line);
+      line = end + 1;
+    }
+    EDITOR.page_clock++;
+  }
+  block->page_used = EDITOR.page_clock;
+  if (EDITOR.page_lru_head != block) {
+    page_lru_push_front(block);
+    trim_pages();
+  }
+  return block->rows;
+}
+
+row_block *row_block_new() {
+  row_block *block = calloc(1, sizeof(row_block));
+  if (block == NULL)
+    die("calloc");
+  page_alloc_rows(block);
+  block->blocks = 1;
+  page_in(block);
+  return block;
+}
+
+// a block of lines lines read from [start, end) of the mapped file on first
+// touch, this may run on a loader thread
+row_block *row_block_new_paged(const char *start, const char *end,
+                               int lines) {
+  row_block *block = calloc(1, sizeof(row_block));
+  if (block == NULL)
+    die("calloc");
+  block->page_start = start;
+  block->page_end = end;
+  block->size = block->lines = lines;
+  block->blocks = 1;
+  return block;
+}
+
+void row_block_insert_after(row_block *block, row_block *next) {
+  row_block *left, *right;
+  row_block_split(EDITOR.rows, row_block_position(block) + 1, &left, &right);
+  EDITOR.rows = row_block_merge(row_block_merge(left, next), right);
+}
+
+void row_block_remove(row_block *block) {
+  row_block *left, *middle, *right;
+  row_block_split(EDITOR.rows, row_block_position(block), &left, &right);
+  row_block_split(right, 1, &middle, &right);
+  EDITOR.rows = row_block_merge(left, right);
+  render_lru_unlink(block);
+  if (block->rows)
+    page_out(block);
+  free(block);
+}
+
+// finds the block holding line *at and turns *at into an index in that block,
+// the line after the last one resolves to the end of the last block
+row_block *row_block_find(int *at) {
+  int line = *at;
+  row_block *block = EDITOR.rows;
+  while (block) {
+    int left_lines = block_lines(block->left);
+    if (*at < left_lines) {
+      block = block->left;
+    } else if (*at <= left_lines + block->size &&
+               (*at < left_lines + block->size || block->right == NULL)) {
+      if (block->page_unchecked) {
+        // verifying the block may change the lines after it, look again
+        page_check(block);
+        block = EDITOR.rows;
+        *at = line;
+        continue;
+      }
+      *at -= left_lines;
+      return block;
     } else {
-      row->render[idx++] = row->chars[j];
+      *at -= left_lines + block->size;
+      block = block->right;
     }
   }
+  return NULL;
+}
 
-  row->render[idx] = '\0';
-  row->render_size = idx;
+editor_row *row_at(int at) {
+  if (at < 0 || at >= EDITOR.number_of_rows)
+    return NULL;
+  row_block *block = row_block_find(&at);
+  // checking the block may have changed the number of rows
+  if (block == NULL || at >= block->size)
+    return NULL;
+  return &page_in(block)[at];
 }
 
-void insert_editor_row_at(int at_y, char *line, ssize_t line_length) {
-  if (at_y < 0 || at_y > EDITOR.number_of_rows)
+row_block *row_block_next(row_block *block) {
+  if (block->right) {
+    block = block->right;
+    while (block->left)
+      block = block->left;
+    return block;
+  }
+  while (block->parent && block == block->parent->right)
+    block = block->parent;
+  return block->parent;
+}
+
+row_block *row_block_previous(row_block *block) {
+  if (block->left) {
+    block = block->left;
+    while (block->right)
+      block = block->right;
+    return block;
+  }
+  while (block->parent && block == block->parent->left)
+    block = block->parent;
+  return block->parent;
+}
+
+// hashes the bytes of a page and the newline before them, eight bytes per
+// step so that it keeps up with the newline scan
+uint64_t page_hash(const char *map, const char *start, const char *end) {
+  if (start > map)
+    start--;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (; end - start >= 8; start += 8) {
+    uint64_t word;
+    memcpy(&word, start, sizeof(word));
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+  }
+  for (; start < end; start++)
+    hash = (hash ^ (unsigned char)*start) * 0x100000001b3ULL;
+  return hash;
+}
+
+// the end of at most limit lines from line, *lines gets their count
+const char *page_count_lines(const char *line, const char *end, int limit,
+                             int *lines) {
+  *lines = 0;
+  while (line < end && *lines < limit) {
+    const char *newline = page_line_end(line, end);
+    line = newline < end ? newline + 1 : end;
+    (*lines)++;
+  }
+  return line;
+}
+
+// counts the lines of a page whose bytes changed since the sidecar it was
+// read from was written, a line belongs to the page it starts in so a page
+// ending inside a line takes the rest of it from the pages after it, which
+// are counted again as well
+void page_recount(row_block *block) {
+  find_all_wait(); // the workers walk the tree
+  const char *map = EDITOR.file_map;
+  const char *map_end = map + EDITOR.file_map_size;
+  row_block *target = block, *previous;
+  while (block->page_start > map && block->page_start[-1] != '\n' &&
+         (previous = row_block_previous(block)) && previous->rows == NULL &&
+         previous->page_end == block->page_start)
+    block = previous;
+
+  bool reached = false, pushed = false;
+  while (block && (!reached || pushed)) {
+    reached = reached || block == target;
+    block->page_unchecked = false;
+    const char *end = block->page_end;
+    if (end > block->page_start && end[-1] != '\n') {
+      const char *newline = memchr(end, '\n', map_end - end);
+      end = newline ? newline + 1 : map_end;
+    }
+    int lines;
+    const char *line =
+        page_count_lines(block->page_start, end, ROW_BLOCK_CAPACITY, &lines);
+    block->page_end = line;
+    block->page_hash = page_hash(map, block->page_start, line);
+    row_block_resize(block, lines - block->size);
+
+    // lines past the capacity of the block go to new pages after it
+    row_block *last = block;
+    while (line < end) {
+      const char *start = line;
+      line = page_count_lines(start, end, ROW_BLOCK_CAPACITY, &lines);
+      row_block *next = row_block_new_paged(start, line, lines);
+      next->page_hash = page_hash(map, start, line);
+      row_block_insert_after(last, next);
+      EDITOR.number_of_rows += lines;
+      last = next;
+    }
+
+    // the pages the last line reached into give up their first bytes, the
+    // first one that keeps some is counted next
+    block = row_block_next(last);
+    while (block && block->page_start < end && block->page_end <= end) {
+      reached = reached || block == target;
+      block->page_start = block->page_end;
+      block->page_unchecked = false;
+      row_block_resize(block, -block->size);
+      block = row_block_next(block);
+    }
+    pushed = block && block->page_start < end;
+    if (pushed)
+      block->page_start = end;
+  }
+}
+
+// a page read from a sidecar is verified the first time it is touched, the
+// lines it was counted with hold while its bytes hash the same
+void page_check(row_block *block) {
+  if (block->page_unchecked &&
+      page_hash(EDITOR.file_map, block->page_start, block->page_end) !=
+          block->page_hash)
+    page_recount(block);
+  block->page_unchecked = false;
+}
+
+// an iterator at number_of_rows sits behind the last row, which is where a
+// backwards walk over the whole document starts
+row_iterator row_iterator_at(int at) {
+  row_iterator it = {NULL, 0};
+  if (at < 0 || at > EDITOR.number_of_rows || EDITOR.rows == NULL)
+    return it;
+  it.block = row_block_find(&at);
+  it.index = at;
+  return it;
+}
+
+// the block after the one the iterator is at, verified before its size is
+// read
+void row_iterator_step(row_iterator *it) {
+  it->block = row_block_next(it->block);
+  it->index = 0;
+  if (it->block)
+    page_check(it->block);
+}
+
+editor_row *row_iterator_next(row_iterator *it) {
+  while (it->block && it->index >= it->block->size)
+    row_iterator_step(it);
+  if (it->block == NULL)
+    return NULL;
+  return &page_in(it->block)[it->index++];
+}
+
+// the block the iterator is at the start of if that block is paged out,
+// its lines can then be read from the file without paging it in
+row_block *row_iterator_page(row_iterator *it) {
+  while (it->block && it->index >= it->block->size)
+    row_iterator_step(it);
+  if (it->block == NULL || it->index > 0 || it->block->rows)
+    return NULL;
+  return it->block;
+}
+
+editor_row *row_iterator_previous(row_iterator *it) {
+  while (it->block && it->index == 0) {
+    // checking may split the block, the pages it adds come after it
+    row_block *previous = row_block_previous(it->block);
+    if (previous && previous->page_unchecked) {
+      page_check(previous);
+      previous = row_block_previous(it->block);
+    }
+    it->block = previous;
+    it->index = it->block ? it->block->size : 0;
+  }
+  if (it->block == NULL)
+    return NULL;
+  return &page_in(it->block)[--it->index];
+}
+
+// makes room for a row at line at and returns the uninitialised slot
+editor_row *row_tree_insert(int at) {
+  if (EDITOR.rows == NULL)
+    EDITOR.rows = row_block_new();
+
+  row_block *block = row_block_find(&at);
+  page_in(block);
+  if (block->size == ROW_BLOCK_CAPACITY) {
+    row_block *next = row_block_new();
+    int half = ROW_BLOCK_CAPACITY / 2;
+    memcpy(next->rows, &block->rows[half], sizeof(editor_row) * half);
+    next->size = half;
+    row_block_resize(block, -half);
+    EDITOR.number_of_rows += half;
+    row_block_update(next);
+    row_block_insert_after(block, next);
+    if (block->in_render_lru)
+      render_lru_push_front(next);
+    if (at > half) {
+      block = next;
+      at -= half;
+    }
+  }
+
+  memmove(&block->rows[at + 1], &block->rows[at],
+          sizeof(editor_row) * (block->size - at));
+  row_block_resize(block, 1);
+  return &block->rows[at];
+}
+
+// splices count prepared rows in before line at, the rows after the split
+// point move to their own block so the cost is O(count + log n)
+void row_tree_insert_rows(int at, editor_row *rows, int count) {
+  if (count == 0)
     return;
+  if (EDITOR.rows == NULL)
+    EDITOR.rows = row_block_new();
+
+  row_block *block = row_block_find(&at);
+  page_in(block);
+  int position = row_block_position(block);
+  int tail = 0;
+  if (at > 0) {
+    position++;
+    tail = block->size - at;
+  }
+
+  int block_total =
+      (count + ROW_BLOCK_CAPACITY - 1) / ROW_BLOCK_CAPACITY + (tail > 0);
+  row_block **blocks = malloc(sizeof(row_block *) * block_total);
+  for (int b = 0; b < block_total; b++)
+    blocks[b] = row_block_new();
+  for (int j = 0; j < count; j++) {
+    row_block *target = blocks[j / ROW_BLOCK_CAPACITY];
+    target->rows[target->size++] = rows[j];
+  }
+  if (tail > 0) {
+    row_block *target = blocks[block_total - 1];
+    memcpy(target->rows, &block->rows[at], sizeof(editor_row) * tail);
+    target->size = tail;
+    row_block_resize(block, -tail);
+    if (block->in_render_lru)
+      render_lru_push_front(target);
+  }
 
-  EDITOR.row =
-      realloc(EDITOR.row, sizeof(editor_row) * (EDITOR.number_of_rows + 1));
-  memmove(&EDITOR.row[at_y + 1], &EDITOR.row[at_y],
-          sizeof(editor_row) * (EDITOR.number_of_rows - at_y));
+  row_block *left, *right;
+  row_block_split(EDITOR.rows, position, &left, &right);
+  EDITOR.rows = row_block_merge(
+      row_block_merge(left, row_block_build(blocks, block_total)), right);
+  EDITOR.number_of_rows += count + tail;
+  free(blocks);
+}
 
-  EDITOR.row[at_y].size = line_length;
-  EDITOR.row[at_y].chars = malloc(line_length + 1);
-  memcpy(EDITOR.row[at_y].chars, line, line_length);
-  EDITOR.row[at_y].chars[line_length] = '\0';
-  EDITOR.number_of_rows++;
+void row_tree_remove(int at) {
+  row_block *block = row_block_find(&at);
+  page_in(block);
+  memmove(&block->rows[at], &block->rows[at + 1],
+          sizeof(editor_row) * (block->size - at - 1));
+  row_block_resize(block, -1);
+  if (block->size == 0 && EDITOR.rows->blocks > 1)
+    row_block_remove(block);
+}
 
-  EDITOR.row[at_y].render_size = 0;
-  EDITOR.row[at_y].render = NULL;
-  update_render_row(&EDITOR.row[at_y]);
+/* row operations */
 
-  EDITOR.file_modified = true;
+char row_char(editor_row *row, int at) {
+  return at < row->gap ? row->chars[at]
+                       : row->chars[at + row->capacity - row->size];
 }
 
-void insert_char_in_row(editor_row *row, int at, int c) {
-  if (at < 0 || at > row->size)
-    at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  update_render_row(row);
+void row_move_gap(editor_row *row, int at) {
+  if (at != row->gap)
+    find_all_wait(); // find all workers may be reading this row
+  int gap_length = row->capacity - row->size;
+  if (at < row->gap)
+    memmove(&row->chars[at + gap_length], &row->chars[at], row->gap - at);
+  else if (at > row->gap)
+    memmove(&row->chars[row->gap], &row->chars[row->gap + gap_length],
+            at - row->gap);
+  row->gap = at;
+}
 
-  EDITOR.file_modified = true;
+// the contiguous text of the row from at to the end, moves the gap to at
+char *row_tail(editor_row *row, int at) {
+  if (row->mapped)
+    return &row->chars[at];
+  row_move_gap(row, at);
+  return &row->chars[at + row->capacity - row->size];
 }
 
-void append_string_to_row(editor_row *row, char *string, size_t length) {
-  row->chars = realloc(row->chars, row->size + length + 1);
-  memcpy(&row->chars[row->size], string, length);
-  row->size += length;
+// the whole row as one NUL terminated string, moves the gap to the end
+char *row_text(editor_row *row) {
+  if (row->mapped)
+    return row->chars;
+  row_move_gap(row, row->size);
   row->chars[row->size] = '\0';
+  return row->chars;
+}
 
-  update_render_row(row);
-  EDITOR.file_modified = true;
+bool utf8_continuation(char c) { return ((unsigned char)c & 0xc0) == 0x80; }
+
+// the length of the UTF-8 sequence at text, invalid, overlong and truncated
+// sequences are a single byte with *codepoint set to -1
+int utf8_decode(const char *text, int length, int *codepoint) {
+  unsigned char c = text[0];
+  int count = c < 0x80    ? 1
+              : c >= 0xf5 ? 0
+              : c >= 0xf0 ? 4
+              : c >= 0xe0 ? 3
+              : c >= 0xc2 ? 2
+                          : 0;
+  *codepoint = c < 0x80 ? c : c & (0x7f >> count);
+  if (count == 0 || count > length) {
+    *codepoint = -1;
+    return 1;
+  }
+  for (int i = 1; i < count; i++) {
+    if (!utf8_continuation(text[i])) {
+      *codepoint = -1;
+      return 1;
+    }
+    *codepoint = (*codepoint << 6) | (text[i] & 0x3f);
+  }
+  static const int least[] = {0, 0, 0x80, 0x800, 0x10000};
+  if (*codepoint < least[count] || *codepoint > 0x10ffff ||
+      (*codepoint >= 0xd800 && *codepoint <= 0xdfff))
+    *codepoint = -1;
+  return *codepoint == -1 ? 1 : count;
 }
 
-void delete_char_in_row(editor_row *row, int at) {
-  if (at < 0 || at >= row->size)
-    return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  update_render_row(row);
-  EDITOR.file_modified = true;
+// columns a codepoint takes in the terminal, combining marks take none and
+// east asian wide characters two, anything unprintable is drawn as one '?'
+int codepoint_width(int codepoint) {
+  static const int zero[][2] = {
+      {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a},
+      {0x064b, 0x065f}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x1ab0, 0x1aff},
+      {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x20d0, 0x20ff}, {0xfe00, 0xfe0f},
+      {0xfe20, 0xfe2f}};
+  static const int wide[][2] = {
+      {0x1100, 0x115f},   {0x2e80, 0x303e},   {0x3041, 0x33ff},
+      {0x3400, 0x4dbf},   {0x4e00, 0x9fff},   {0xa000, 0xa4cf},
+      {0xac00, 0xd7a3},   {0xf900, 0xfaff},   {0xfe30, 0xfe4f},
+      {0xff00, 0xff60},   {0xffe0, 0xffe6},   {0x1f300, 0x1f64f},
+      {0x1f900, 0x1f9ff}, {0x20000, 0x2fffd}, {0x30000, 0x3fffd}};
+  if (codepoint < 0x300)
+    return 1;
+  for (size_t i = 0; i < sizeof(zero) / sizeof(zero[0]); i++)
+    if (codepoint >= zero[i][0] && codepoint <= zero[i][1])
+      return 0;
+  for (size_t i = 0; i < sizeof(wide) / sizeof(wide[0]); i++)
+    if (codepoint >= wide[i][0] && codepoint <= wide[i][1])
+      return 2;
+  return 1;
 }
 
-void free_row(editor_row *row) {
-  free(row->chars);
-  free(row->render);
+// the char at at of the row copied to bytes, returns its length in bytes
+int row_decode(editor_row *row, int at, char *bytes, int *codepoint) {
+  int length = 0;
+  while (length < 4 && at + length < row->size) {
+    bytes[length] = row_char(row, at + length);
+    length++;
+  }
+  return utf8_decode(bytes, length, codepoint);
 }
 
-void delete_row(int at) {
-  if (at < 0 || at >= EDITOR.number_of_rows)
+// bytes before the first tab or non ascii byte, each takes one column
+int plain_run(const char *text, int length) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128i tab = _mm_set1_epi8('\t');
+  for (; i + 16 <= length; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)&text[i]);
+    // the sign bit is set for non ascii bytes and for tabs after the or
+    int mask =
+        _mm_movemask_epi8(_mm_or_si128(bytes, _mm_cmpeq_epi8(bytes, tab)));
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+#endif
+  while (i < length && text[i] != '\t' && (unsigned char)text[i] < 0x80)
+    i++;
+  return i;
+}
+
+bool text_is_ascii(const char *text, int length) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128i high = _mm_setzero_si128();
+  for (; i + 16 <= length; i += 16)
+    high = _mm_or_si128(high, _mm_loadu_si128((const __m128i *)&text[i]));
+  if (_mm_movemask_epi8(high))
+    return false;
+#endif
+  for (; i < length; i++)
+    if ((unsigned char)text[i] >= 0x80)
+      return false;
+  return true;
+}
+
+bool row_is_ascii(editor_row *row) {
+  return text_is_ascii(row->chars, row->gap) &&
+         text_is_ascii(&row->chars[row->gap + row->capacity - row->size],
+                       row->size - row->gap);
+}
+
+// the first char boundary at or after at, a char cut by at belongs to the
+// columns before it
+int skip_cut_char(editor_row *row, int at) {
+  int lead = at;
+  while (lead > 0 && at - lead < 3 && at < row->size &&
+         utf8_continuation(row_char(row, lead)))
+    lead--;
+  if (lead == at)
+    return at;
+  char bytes[4];
+  int codepoint;
+  int end = lead + row_decode(row, lead, bytes, &codepoint);
+  return end > at ? end : at;
+}
+
+// the start of the char covering at
+int char_start(editor_row *row, int at) {
+  int start = at;
+  while (start > 0 && at - start < 3 && utf8_continuation(row_char(row, start)))
+    start--;
+  char bytes[4];
+  int codepoint;
+  return start + row_decode(row, start, bytes, &codepoint) > at ? start : at;
+}
+
+// the render column after chars [from, to) of the row when from is at
+// column, ascii runs are skipped without decoding
+int row_render_columns(editor_row *row, int from, int to, int column) {
+  int x = skip_cut_char(row, from);
+  while (x < to) {
+    int end = x < row->gap && to > row->gap ? row->gap : to;
+    const char *text = x < row->gap
+                           ? &row->chars[x]
+                           : &row->chars[x + row->capacity - row->size];
+    int run = plain_run(text, end - x);
+    column += run;
+    x += run;
+    if (x == end)
+      continue;
+
+    if (row_char(row, x) == '\t') {
+      column += EDI_TAB_STOP - column % EDI_TAB_STOP;
+      x++;
+    } else {
+      char bytes[4];
+      int codepoint;
+      x += row_decode(row, x, bytes, &codepoint);
+      column += codepoint_width(codepoint);
+    }
+  }
+  return column;
+}
+
+void free_column_map(editor_row *row) {
+  if (row->columns == NULL)
     return;
+  EDITOR.render_bytes -=
+      sizeof(column_map) + sizeof(int) * row->columns->capacity;
+  free(row->columns);
+  row->columns = NULL;
+}
 
-  free_row(&EDITOR.row[at]);
-  memmove(&EDITOR.row[at], &EDITOR.row[at + 1],
-          sizeof(editor_row) * (EDITOR.number_of_rows - at - 1));
-  EDITOR.number_of_rows--;
-  EDITOR.file_modified = true;
+// the column map of a long row, grown to cover the row, NULL for shorter
+// rows which render whole
+column_map *row_columns(editor_row *row) {
+  if (row->size < EDI_LONG_ROW_SIZE) {
+    if (row->columns) {
+      free_column_map(row);
+      row->render_dirty = true; // render holds a slice
+    }
+    return NULL;
+  }
+
+  int needed = row->size / EDI_COLUMN_SPAN + 1;
+  column_map *columns = row->columns;
+  if (columns == NULL || columns->capacity < needed) {
+    int capacity = needed + needed / 4;
+    int old_capacity = columns ? columns->capacity : 0;
+    columns = realloc(columns, sizeof(column_map) + sizeof(int) * capacity);
+    if (columns == NULL)
+      die("realloc");
+    if (row->columns == NULL) {
+      columns->valid = 1;
+      columns->at[0] = 0;
+      columns->render_start = -1;
+      columns->render_width = 0;
+    }
+    columns->capacity = capacity;
+    EDITOR.render_bytes += sizeof(int) * (capacity - old_capacity) +
+                           (old_capacity ? 0 : sizeof(column_map));
+    row->columns = columns;
+  }
+  return columns;
 }
 
-/* editor operations */
-void insert_char(int c) {
-  if (EDITOR.cursor_y == EDITOR.number_of_rows) {
-    insert_editor_row_at(EDITOR.number_of_rows, "", 0);
+// checkpoints up to char at on stay valid, later ones are rebuilt on demand
+void invalidate_columns(editor_row *row, int at) {
+  if (row->columns == NULL)
+    return;
+  if (row->columns->valid > at / EDI_COLUMN_SPAN + 1)
+    row->columns->valid = at / EDI_COLUMN_SPAN + 1;
+  row->columns->render_start = -1;
+}
+
+// makes checkpoint i current, i * EDI_COLUMN_SPAN must not pass the row end
+void extend_columns(editor_row *row, column_map *columns, int i) {
+  while (columns->valid <= i) {
+    int k = columns->valid++;
+    columns->at[k] = row_render_columns(row, (k - 1) * EDI_COLUMN_SPAN,
+                                        k * EDI_COLUMN_SPAN,
+                                        columns->at[k - 1]);
   }
-  insert_char_in_row(&EDITOR.row[EDITOR.cursor_y], EDITOR.cursor_x, c);
-  EDITOR.cursor_x++;
 }
 
-void insert_new_line() {
-  if (EDITOR.cursor_x == 0) {
-    insert_editor_row_at(EDITOR.cursor_y, "", 0);
-  } else {
-    editor_row *row = &EDITOR.row[EDITOR.cursor_y];
-    insert_editor_row_at(EDITOR.cursor_y + 1, &row->chars[EDITOR.cursor_x],
-                         row->size - EDITOR.cursor_x);
+int cursor_x_to_render_x(editor_row *row, int cursor_x) {
+  column_map *columns = row_columns(row);
+  if (columns == NULL)
+    return row_render_columns(row, 0, cursor_x, 0);
+
+  int i = cursor_x / EDI_COLUMN_SPAN;
+  extend_columns(row, columns, i);
+  return row_render_columns(row, i * EDI_COLUMN_SPAN, cursor_x,
+                            columns->at[i]);
+}
 
-    row = &EDITOR.row[EDITOR.cursor_y];
-    row->size = EDITOR.cursor_x;
-    row->chars[row->size] = '\0';
-    update_render_row(row);
+// the char of a long row covering render column render_x, or the row size
+// when the row ends before it, *column is set to where that char starts
+int render_x_to_cursor_x(editor_row *row, column_map *columns, int render_x,
+                         int *column) {
+  int last = row->size / EDI_COLUMN_SPAN;
+  while (columns->valid <= last &&
+         columns->at[columns->valid - 1] <= render_x)
+    extend_columns(row, columns, columns->valid);
+
+  int low = 0, high = columns->valid - 1; // the last checkpoint <= render_x
+  while (low < high) {
+    int middle = (low + high + 1) / 2;
+    if (columns->at[middle] <= render_x)
+      low = middle;
+    else
+      high = middle - 1;
   }
 
-  EDITOR.cursor_y++;
-  EDITOR.cursor_x = 0;
+  int x = skip_cut_char(row, low * EDI_COLUMN_SPAN);
+  *column = columns->at[low];
+  while (x < row->size) {
+    char bytes[4];
+    int codepoint;
+    int length = row_decode(row, x, bytes, &codepoint);
+    int next = bytes[0] == '\t'
+                   ? *column + EDI_TAB_STOP - *column % EDI_TAB_STOP
+                   : *column + codepoint_width(codepoint);
+    if (next > render_x)
+      break;
+    *column = next;
+    x += length;
+  }
+  return x;
 }
 
-void delete_char() {
-  if (EDITOR.cursor_y == EDITOR.number_of_rows)
+void reserve_render_row(editor_row *row, int length) {
+  if (length + 1 <= row->render_capacity)
     return;
+  int capacity = row->render_capacity * 2;
+  if (capacity < length + 1)
+    capacity = length + 1;
+  capacity = pool_capacity(capacity);
+
+  char *render = pool_alloc(capacity);
+  if (row->render) // widths may follow the text
+    memcpy(render, row->render, row->render_capacity);
+  pool_free(row->render, row->render_capacity);
+  EDITOR.render_bytes += capacity - row->render_capacity;
+  row->render = render;
+  row->render_capacity = capacity;
+}
 
-  if (EDITOR.cursor_x == 0 && EDITOR.cursor_y == 0)
+// appends to a render row that is being built
+void render_append(editor_row *row, const char *bytes, int length) {
+  reserve_render_row(row, row->render_size + length);
+  memcpy(&row->render[row->render_size], bytes, length);
+  row->render_size += length;
+}
+
+// the display width of the char starting at every byte of a non ascii
+// render row, 0 for the bytes continuing a char
+unsigned char *render_widths(editor_row *row) {
+  return (unsigned char *)&row->render[row->render_size + 1];
+}
+
+// the highlight of every render byte, behind the widths if there are any
+unsigned char *render_colors(editor_row *row) {
+  return render_widths(row) + (row->render_ascii ? 0 : row->render_size);
+}
+
+// closes a render row built with render_append, rows that are not plain
+// ascii cache the width of every char behind the text
+void finish_render_row(editor_row *row) {
+  row->render[row->render_size] = '\0';
+  row->render_dirty = false;
+  row->render_entry = HL_UNKNOWN;
+  row->render_ascii = text_is_ascii(row->render, row->render_size);
+  if (row->render_ascii)
     return;
 
-  editor_row *row = &EDITOR.row[EDITOR.cursor_y];
-  if (EDITOR.cursor_x > 0) {
-    delete_char_in_row(row, EDITOR.cursor_x - 1);
-    EDITOR.cursor_x--;
-  } else {
-    EDITOR.cursor_x = EDITOR.row[EDITOR.cursor_y - 1].size;
-    append_string_to_row(&EDITOR.row[EDITOR.cursor_y - 1], row->chars,
-                         row->size);
-    delete_row(EDITOR.cursor_y);
-    EDITOR.cursor_y--;
+  reserve_render_row(row, row->render_size * 2 + 1);
+  unsigned char *widths = render_widths(row);
+  for (int i = 0; i < row->render_size;) {
+    int codepoint;
+    int length = utf8_decode(&row->render[i], row->render_size - i, &codepoint);
+    widths[i] = codepoint_width(codepoint);
+    for (int j = 1; j < length; j++)
+      widths[i + j] = 0;
+    i += length;
   }
 }
 
-/* file i/o */
+// appends the char at x of the row, unprintable chars become '?', returns
+// its length in bytes and sets *width to its columns
+int render_append_char(editor_row *row, int x, int *width) {
+  char bytes[4];
+  int codepoint;
+  int length = row_decode(row, x, bytes, &codepoint);
+  *width = codepoint_width(codepoint);
+  if (codepoint == -1 || (codepoint >= 0x80 && codepoint < 0xa0))
+    render_append(row, "?", 1);
+  else
+    render_append(row, bytes, length);
+  return length;
+}
+
+void update_render_row(editor_row *row) {
+  PERF.render_updates++;
+  if (!row_is_ascii(row)) {
+    row->render_size = 0;
+    row->render_tabs = 0;
+    int column = 0;
+    for (int x = 0; x < row->size;) {
+      if (row_char(row, x) == '\t') {
+        row->render_tabs++;
+        do
+          render_append(row, " ", 1);
+        while (++column % EDI_TAB_STOP != 0);
+        x++;
+      } else {
+        int width;
+        x += render_append_char(row, x, &width);
+        column += width;
+      }
+    }
+    reserve_render_row(row, row->render_size);
+    finish_render_row(row);
+    return;
+  }
+
+  int tabs = 0;
+  for (int j = 0; j < row->size; j++) {
+    if (row_char(row, j) == '\t')
+      tabs++;
+  }
 
-char *editor_row_to_string(int *buffer_length) {
-  int total_length = 0;
+  reserve_render_row(row, row->size + tabs * (EDI_TAB_STOP - 1));
+  int idx = 0;
+
+  for (int j = 0; j < row->size; j++) {
+    char c = row_char(row, j);
+    if (c == '\t') {
+      row->render[idx++] = ' ';
+      while (idx % EDI_TAB_STOP != 0)
+        row->render[idx++] = ' ';
+    } else {
+      row->render[idx++] = c;
+    }
+  }
+
+  row->render[idx] = '\0';
+  row->render_size = idx;
+  row->render_tabs = tabs;
+  row->render_dirty = false;
+  row->render_ascii = true;
+  row->render_entry = HL_UNKNOWN;
+}
+
+// renders the columns [start, start + width) of a long row
+void update_render_slice(editor_row *row, column_map *columns, int start,
+                         int width) {
+  PERF.render_updates++;
+  int column;
+  int x = render_x_to_cursor_x(row, columns, start, &column);
+  int end = start + width;
+  row->render_size = 0;
+  reserve_render_row(row, width);
+  while (x < row->size && column < end) {
+    char bytes[4];
+    int codepoint;
+    int length = row_decode(row, x, bytes, &codepoint);
+    int next = bytes[0] == '\t'
+                   ? column + EDI_TAB_STOP - column % EDI_TAB_STOP
+                   : column + codepoint_width(codepoint);
+    if (bytes[0] == '\t' || column < start) {
+      // tabs and a wide char cut by the left edge show as blanks
+      for (; column < next && column < end; column++) {
+        if (column >= start)
+          render_append(row, " ", 1);
+      }
+    } else if (next > end) {
+      break; // a wide char cut by the right edge is left out
+    } else {
+      int char_width;
+      render_append_char(row, x, &char_width);
+    }
+    column = next;
+    x += length;
+  }
+
+  row->render_tabs = 0;
+  reserve_render_row(row, row->render_size);
+  finish_render_row(row);
+  columns->render_start = start;
+  columns->render_width = width;
+}
+
+// without tabs render is a copy of chars and an edit can be patched in
+// place, anything else is rebuilt on the next draw
+void render_row_splice(editor_row *row, int at, int removed,
+                       const char *string, int length) {
+  if (row->columns) {
+    invalidate_columns(row, at);
+    row->render_dirty = true;
+    return;
+  }
+  if (row->render_dirty || row->render == NULL || row->render_tabs > 0 ||
+      !row->render_ascii || row->render_entry != HL_UNKNOWN ||
+      memchr(string, '\t', length) != NULL || !text_is_ascii(string, length)) {
+    row->render_dirty = true;
+    return;
+  }
+
+  reserve_render_row(row, row->render_size - removed + length);
+  memmove(&row->render[at + length], &row->render[at + removed],
+          row->render_size - at - removed + 1);
+  memcpy(&row->render[at], string, length);
+  row->render_size += length - removed;
+}
+
+void free_render_row(editor_row *row) {
+  free_column_map(row);
+  if (row->render == NULL)
+    return;
+  EDITOR.render_bytes -= row->render_capacity;
+  pool_free(row->render, row->render_capacity);
+  row->render = NULL;
+  row->render_size = 0;
+  row->render_capacity = 0;
+  row->render_dirty = true;
+  row->render_entry = HL_UNKNOWN;
+}
+
+// drop render rows of the least recently drawn blocks until the cache fits
+// the budget again, blocks drawn in the current frame are kept
+void trim_render_cache(row_block *keep) {
+  row_block *block = EDITOR.render_lru_tail;
+  while (EDITOR.render_bytes > EDI_RENDER_BUDGET && block) {
+    row_block *previous = block->lru_prev;
+    if (block != keep && block->render_frame != EDITOR.frame) {
+      for (int j = 0; j < block->size; j++)
+        free_render_row(&block->rows[j]);
+      render_lru_unlink(block);
+    }
+    block = previous;
+  }
+}
+
+// render rows are only built for rows that are drawn or searched, long
+// rows hold only the columns on screen
+editor_row *render_row(row_block *block, editor_row *row) {
+  column_map *columns = row_columns(row);
+  bool stale = row->render_dirty;
+  if (columns)
+    stale = stale || columns->render_start != EDITOR.col_offset ||
+            columns->render_width != EDITOR.screen_cols;
+  if (stale) {
+    if (columns)
+      update_render_slice(row, columns, EDITOR.col_offset, EDITOR.screen_cols);
+    else
+      update_render_row(row);
+    if (EDITOR.render_bytes > EDI_RENDER_BUDGET)
+      trim_render_cache(block);
+  }
+  highlight_render_row(block, row);
+  if (EDITOR.render_lru_head != block)
+    render_lru_push_front(block);
+  return row;
+}
+
+void init_row_chars(editor_row *row, char *chars, int capacity,
+                    const char *line, int line_length) {
+  row->size = line_length;
+  row->capacity = capacity;
+  row->gap = line_length;
+  row->chars = chars;
+  memcpy(row->chars, line, line_length);
+  row->chars[line_length] = '\0';
+
+  row->render_size = 0;
+  row->render_capacity = 0;
+  row->render_tabs = 0;
+  row->render = NULL;
+  row->columns = NULL;
+  row->render_dirty = true;
+  row->render_entry = HL_UNKNOWN;
+  row->hl_state = HL_UNKNOWN;
+  row->mapped = false;
+  row->in_arena = false;
+}
+
+void init_owned_row(editor_row *row, const char *line, int line_length) {
+  int capacity = pool_capacity(line_length + 1);
+  init_row_chars(row, pool_alloc(capacity), capacity, line, line_length);
+}
+
+// bulk loaded rows are packed into the arena until they are first edited
+void init_arena_row(editor_row *row, const char *line, int line_length) {
+  init_row_chars(row, arena_alloc(line_length + 1), line_length + 1, line,
+                 line_length);
+  row->in_arena = true;
+}
+
+void release_row_chars(editor_row *row) {
+  if (row->mapped)
+    return;
+  if (row->in_arena)
+    arena_release(row->capacity);
+  else
+    pool_free(row->chars, row->capacity);
+  row->in_arena = false;
+}
+
+void insert_editor_row_at(int at_y, char *line, ssize_t line_length) {
+  if (at_y < 0 || at_y > EDITOR.number_of_rows)
+    return;
+
+  init_owned_row(row_tree_insert(at_y), line, line_length);
+  EDITOR.file_modified = true;
+}
+
+// grows the gap geometrically so it holds at least length more bytes and
+// the terminating NUL, mapped rows get their own chars here on the first edit
+void row_reserve(editor_row *row, int length) {
+  if (!row->mapped && row->size + length < row->capacity)
+    return;
+
+  int capacity = row->capacity * 2;
+  if (capacity < row->size + length + 1)
+    capacity = row->size + length + 1;
+  capacity = pool_capacity(capacity);
+
+  char *chars = pool_alloc(capacity);
+  int after_gap = row->size - row->gap;
+  memcpy(chars, row->chars, row->gap);
+  memcpy(&chars[capacity - after_gap],
+         &row->chars[row->gap + row->capacity - row->size], after_gap);
+  release_row_chars(row);
+  row->chars = chars;
+  row->capacity = capacity;
+  row->mapped = false;
+}
+
+void insert_string_in_row(editor_row *row, int at, const char *string,
+                          int length) {
+  if (at < 0 || at > row->size)
+    at = row->size;
+  row_reserve(row, length);
+  row_move_gap(row, at);
+  memcpy(&row->chars[at], string, length);
+  row->gap += length;
+  row->size += length;
+  render_row_splice(row, at, 0, string, length);
+
+  EDITOR.file_modified = true;
+}
+
+void insert_char_in_row(editor_row *row, int at, int c) {
+  char ch = c;
+  insert_string_in_row(row, at, &ch, 1);
+}
+
+void append_string_to_row(editor_row *row, char *string, size_t length) {
+  insert_string_in_row(row, row->size, string, length);
+}
+
+void delete_char_in_row(editor_row *row, int at) {
+  if (at < 0 || at >= row->size)
+    return;
+  if (row_char(row, at) == '\t')
+    row->render_dirty = true;
+  row_reserve(row, 0);
+  row_move_gap(row, at + 1);
+  row->gap--;
+  row->size--;
+  render_row_splice(row, at, 1, "", 0);
+  EDITOR.file_modified = true;
+}
+
+// cuts the row at at, a mapped view is simply shortened
+void truncate_row(editor_row *row, int at) {
+  if (!row->mapped)
+    row_move_gap(row, at);
+  row->gap = at;
+  row->size = at;
+  row->render_dirty = true;
+  invalidate_columns(row, at);
+}
+
+// replaces the whole text of the row, the render is rebuilt once on the
+// next draw
+void set_row_text(editor_row *row, const char *text, int length) {
+  release_row_chars(row);
+  int capacity = pool_capacity(length + 1);
+  row->chars = pool_alloc(capacity);
+  if (length > 0)
+    memcpy(row->chars, text, length);
+  row->capacity = capacity;
+  row->size = length;
+  row->gap = length;
+  row->mapped = false;
+  row->render_dirty = true;
+  invalidate_columns(row, 0);
+  EDITOR.file_modified = true;
+}
+
+void free_row(editor_row *row) {
+  release_row_chars(row);
+  free_render_row(row);
+}
+
+void delete_row(int at) {
+  if (at < 0 || at >= EDITOR.number_of_rows)
+    return;
+
+  free_row(row_at(at));
+  row_tree_remove(at);
+  EDITOR.file_modified = true;
+}
+
+/* syntax highlighting */
+
+enum highlight {
+  HL_NORMAL,
+  HL_COMMENT,
+  HL_KEYWORD,
+  HL_TYPE,
+  HL_STRING,
+  HL_NUMBER
+};
+
+// the only state that outlives a line is being inside a block comment
+enum lexer_state { LEX_NORMAL, LEX_COMMENT };
+
+struct syntax {
+  const char *name;
+  const char **extensions;
+  const char **keywords; // types end with '|'
+  bool c_comments; // comments and character literals of C
+};
+
+const char *C_EXTENSIONS[] = {".c", ".h", ".cc", ".cpp", ".hpp", NULL};
+const char *C_KEYWORDS[] = {
+    "auto", "break", "case", "const", "continue", "default", "do", "else",
+    "enum", "extern", "for", "goto", "if", "inline", "register", "restrict",
+    "return", "sizeof", "static", "struct", "switch", "typedef", "union",
+    "volatile", "while", "#include", "#define", "#undef", "#if", "#ifdef",
+    "#ifndef", "#else", "#elif", "#endif", "NULL", "true", "false",
+    "int|", "long|", "short|", "char|", "float|", "double|", "signed|",
+    "unsigned|", "void|", "bool|", "size_t|", "ssize_t|", "off_t|",
+    "int8_t|", "int16_t|", "int32_t|", "int64_t|", "uint8_t|", "uint16_t|",
+    "uint32_t|", "uint64_t|", NULL};
+const char *JSON_EXTENSIONS[] = {".json", NULL};
+const char *JSON_KEYWORDS[] = {"true", "false", "null", NULL};
+
+struct syntax SYNTAXES[] = {
+    {"c", C_EXTENSIONS, C_KEYWORDS, true},
+    {"json", JSON_EXTENSIONS, JSON_KEYWORDS, false},
+};
+
+void select_syntax(const char *filename) {
+  EDITOR.syntax = NULL;
+  EDITOR.highlight_frontier = 0;
+  const char *extension = filename ? strrchr(filename, '.') : NULL;
+  if (extension == NULL)
+    return;
+  for (size_t i = 0; i < sizeof(SYNTAXES) / sizeof(SYNTAXES[0]); i++) {
+    for (const char **e = SYNTAXES[i].extensions; *e; e++) {
+      if (strcmp(extension, *e) == 0)
+        EDITOR.syntax = &SYNTAXES[i];
+    }
+  }
+}
+
+bool is_separator(unsigned char c) {
+  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}:&|^!?\"'", c);
+}
+
+int keyword_highlight(struct syntax *syntax, const char *word, int length) {
+  for (const char **keyword = syntax->keywords; *keyword; keyword++) {
+    int keyword_length = strlen(*keyword);
+    bool type = (*keyword)[keyword_length - 1] == '|';
+    if (type)
+      keyword_length--;
+    if (keyword_length == length && memcmp(word, *keyword, length) == 0)
+      return type ? HL_TYPE : HL_KEYWORD;
+  }
+  return HL_NORMAL;
+}
+
+// lexes a line that starts in state and returns the state after it, colors
+// gets a highlight per byte unless only the state is wanted
+unsigned char lex_line(struct syntax *syntax, const char *text, int length,
+                       unsigned char state, unsigned char *colors) {
+  int i = 0;
+  bool separated = true; // the byte before i ends a word
+  while (i < length) {
+    unsigned char c = text[i];
+    int start = i;
+    int highlight = HL_NORMAL;
+    if (state == LEX_COMMENT) {
+      const char *close = memmem(&text[i], length - i, "*/", 2);
+      i = close ? close - text + 2 : length;
+      state = close ? LEX_NORMAL : LEX_COMMENT;
+      highlight = HL_COMMENT;
+    } else if (syntax->c_comments && c == '/' && i + 1 < length &&
+               (text[i + 1] == '/' || text[i + 1] == '*')) {
+      state = text[i + 1] == '*' ? LEX_COMMENT : LEX_NORMAL;
+      i = text[i + 1] == '*' ? i + 2 : length;
+      highlight = HL_COMMENT;
+    } else if (c == '"' || (c == '\'' && syntax->c_comments)) {
+      for (i++; i < length && text[i] != (char)c; i++) {
+        if (text[i] == '\\')
+          i++;
+      }
+      i = i < length ? i + 1 : length;
+      highlight = HL_STRING;
+    } else if (separated && isdigit(c)) {
+      while (i < length && (!is_separator(text[i]) || text[i] == '.'))
+        i++;
+      highlight = HL_NUMBER;
+    } else if (separated && !is_separator(c)) {
+      while (i < length && !is_separator(text[i]))
+        i++;
+      highlight = keyword_highlight(syntax, &text[start], i - start);
+    } else {
+      i++;
+    }
+    if (colors)
+      memset(&colors[start], highlight, i - start);
+    separated = highlight != HL_NORMAL || is_separator(text[i - 1]);
+  }
+  return state;
+}
+
+// lexes every row of the block starting in state, returns the state after
+unsigned char lex_block(row_block *block, unsigned char state) {
+  editor_row *rows = page_in(block);
+  block->hl_start = state;
+  for (int j = 0; j < block->size; j++) {
+    editor_row *row = &rows[j];
+    const char *text = row->mapped ? row->chars : row_text(row);
+    state = lex_line(EDITOR.syntax, text, row->size, state, NULL);
+    row->hl_state = state;
+  }
+  block->hl_end = state;
+  block->hl_current = true;
+  return state;
+}
+
+// an edit of row y, the frontier goes back to the start of its block so
+// every block before the frontier stays current
+void highlight_edited(int y) {
+  if (y >= EDITOR.number_of_rows)
+    y = EDITOR.number_of_rows - 1;
+  if (y < 0) {
+    EDITOR.highlight_frontier = 0;
+    return;
+  }
+  int at = y;
+  row_block *block = row_block_find(&at);
+  block->hl_current = false;
+  if (y - at < EDITOR.highlight_frontier)
+    EDITOR.highlight_frontier = y - at;
+}
+
+// lexes from the frontier on until it passes row rows, blocks that were not
+// edited and are entered in the state they were lexed with are skipped, so
+// an edit costs only the rows until the states agree again
+void highlight_advance(int rows) {
+  if (EDITOR.syntax == NULL || !EDITOR.syntax->c_comments)
+    return; // every line starts in LEX_NORMAL
+  if (rows > EDITOR.number_of_rows)
+    rows = EDITOR.number_of_rows;
+  if (EDITOR.highlight_frontier >= rows)
+    return;
+
+  int at = EDITOR.highlight_frontier;
+  row_block *block = row_block_find(&at);
+  row_block *previous = row_block_previous(block);
+  unsigned char state = previous ? previous->hl_end : LEX_NORMAL;
+  int position = EDITOR.highlight_frontier - at;
+  for (; block && position < rows; block = row_block_next(block)) {
+    if (block->hl_current && block->hl_start == state)
+      state = block->hl_end;
+    else
+      state = lex_block(block, state);
+    position += block->size;
+  }
+  EDITOR.highlight_frontier = position;
+}
+
+// colors a freshly built render row or one whose entry state changed, rows
+// past the frontier and long rows stay plain
+void highlight_render_row(row_block *block, editor_row *row) {
+  if (EDITOR.syntax == NULL || row->columns)
+    return;
+  unsigned char state = LEX_NORMAL;
+  if (EDITOR.syntax->c_comments) {
+    int j = row - block->rows;
+    if (EDITOR.highlight_frontier < EDITOR.number_of_rows &&
+        row_block_position(block) + j >= EDITOR.highlight_frontier)
+      return;
+    if (j > 0 && block->rows[j - 1].hl_state == HL_UNKNOWN)
+      lex_block(block, block->hl_start); // the block was paged in again
+    state = j == 0 ? block->hl_start : block->rows[j - 1].hl_state;
+  }
+  if (row->render_entry == state)
+    return;
+
+  int offset =
+      (unsigned char *)render_colors(row) - (unsigned char *)row->render;
+  reserve_render_row(row, offset + row->render_size);
+  lex_line(EDITOR.syntax, row->render, row->render_size, state,
+           render_colors(row));
+  row->render_entry = state;
+}
+
+/* editor operations */
+void insert_char(int c) {
+  find_all_discard();
+  highlight_edited(EDITOR.cursor_y);
+  if (EDITOR.cursor_y == EDITOR.number_of_rows) {
+    insert_editor_row_at(EDITOR.number_of_rows, "", 0);
+  }
+  insert_char_in_row(row_at(EDITOR.cursor_y), EDITOR.cursor_x, c);
+  EDITOR.cursor_x++;
+}
+
+void insert_new_line() {
+  find_all_discard();
+  highlight_edited(EDITOR.cursor_y);
+  if (EDITOR.cursor_x == 0) {
+    insert_editor_row_at(EDITOR.cursor_y, "", 0);
+  } else {
+    editor_row *row = row_at(EDITOR.cursor_y);
+    insert_editor_row_at(EDITOR.cursor_y + 1,
+                         row_tail(row, EDITOR.cursor_x),
+                         row->size - EDITOR.cursor_x);
+
+    truncate_row(row_at(EDITOR.cursor_y), EDITOR.cursor_x);
+  }
+
+  EDITOR.cursor_y++;
+  EDITOR.cursor_x = 0;
+}
+
+int line_break_length(const char *text, int length) {
+  if (text[0] == '\r' && length > 1 && text[1] == '\n')
+    return 2;
+  return text[0] == '\r' || text[0] == '\n';
+}
+
+// inserts pasted text at the cursor, all new lines are spliced into the row
+// tree in one batch and rendered lazily when drawn
+void insert_text(const char *text, int length) {
+  if (length == 0)
+    return;
+  find_all_discard();
+  highlight_edited(EDITOR.cursor_y);
+  if (EDITOR.cursor_y == EDITOR.number_of_rows)
+    insert_editor_row_at(EDITOR.number_of_rows, "", 0);
+
+  int line_length = 0;
+  while (line_length < length && !line_break_length(&text[line_length], 1))
+    line_length++;
+
+  editor_row *row = row_at(EDITOR.cursor_y);
+  if (line_length == length) {
+    insert_string_in_row(row, EDITOR.cursor_x, text, length);
+    EDITOR.cursor_x += length;
+    return;
+  }
+
+  // the rest of the cursor row moves behind the last pasted line
+  int tail_length = row->size - EDITOR.cursor_x;
+  char *tail = malloc(tail_length + 1);
+  memcpy(tail, row_tail(row, EDITOR.cursor_x), tail_length);
+  truncate_row(row, EDITOR.cursor_x);
+  insert_string_in_row(row, EDITOR.cursor_x, text, line_length);
+
+  int capacity = 64;
+  int count = 0;
+  editor_row *rows = malloc(sizeof(editor_row) * capacity);
+  const char *p = &text[line_length];
+  const char *end = &text[length];
+  while (p < end) {
+    p += line_break_length(p, end - p);
+    const char *line = p;
+    while (p < end && !line_break_length(p, 1))
+      p++;
+
+    if (count == capacity) {
+      capacity *= 2;
+      rows = realloc(rows, sizeof(editor_row) * capacity);
+    }
+    init_owned_row(&rows[count++], line, p - line);
+  }
+
+  editor_row *last = &rows[count - 1];
+  EDITOR.cursor_x = last->size;
+  append_string_to_row(last, tail, tail_length);
+  free(tail);
+
+  row_tree_insert_rows(EDITOR.cursor_y + 1, rows, count);
+  free(rows);
+  EDITOR.cursor_y += count;
+  EDITOR.file_modified = true;
+}
+
+void delete_char() {
+  if (EDITOR.cursor_y == EDITOR.number_of_rows)
+    return;
+
+  if (EDITOR.cursor_x == 0 && EDITOR.cursor_y == 0)
+    return;
+
+  find_all_discard();
+  highlight_edited(EDITOR.cursor_x > 0 ? EDITOR.cursor_y : EDITOR.cursor_y - 1);
+  editor_row *row = row_at(EDITOR.cursor_y);
+  if (EDITOR.cursor_x > 0) {
+    int at = char_start(row, EDITOR.cursor_x - 1);
+    while (EDITOR.cursor_x > at)
+      delete_char_in_row(row, --EDITOR.cursor_x);
+  } else {
+    editor_row *previous = row_at(EDITOR.cursor_y - 1);
+    EDITOR.cursor_x = previous->size;
+    append_string_to_row(previous, row_text(row), row->size);
+    delete_row(EDITOR.cursor_y);
+    EDITOR.cursor_y--;
+  }
+}
+
+/* file i/o */
+
+void release_file_map() {
+  if (EDITOR.file_map == NULL)
+    return;
+  munmap(EDITOR.file_map, EDITOR.file_map_size);
+  close(EDITOR.file_fd);
+  EDITOR.file_map = NULL;
+  EDITOR.file_map_size = 0;
+  EDITOR.file_fd = -1;
+}
+
+// point every row into map, a mapping of fd holding the rows joined by
+// newlines, this also drops the private copies of edited rows and makes
+// every block a page of the new file
+void rebase_rows(int fd, char *map, size_t length) {
+  size_t offset = 0;
+  row_block *block = row_iterator_at(0).block;
+  for (; block; block = row_block_next(block)) {
+    if (page_is_saved_as_is(block)) {
+      // its bytes went out unchanged, so it moves without being paged in
+      size_t span = block->page_end - block->page_start;
+      block->page_start = &map[offset];
+      offset += span;
+      block->page_end = &map[offset];
+      continue;
+    }
+    editor_row *rows = page_in(block);
+    block->page_start = &map[offset];
+    for (int j = 0; j < block->size; j++) {
+      editor_row *row = &rows[j];
+      release_row_chars(row);
+      row->chars = &map[offset];
+      row->capacity = 0;
+      row->gap = row->size;
+      row->mapped = true;
+      offset += row->size + 1;
+    }
+    block->page_end = &map[offset];
+  }
+
+  release_file_map();
+  EDITOR.file_map = map;
+  EDITOR.file_map_size = length;
+  EDITOR.file_fd = fd;
+}
+
+void init_mapped_row(editor_row *row, char *line, size_t line_length) {
+  while (line_length > 0 && line[line_length - 1] == ENTER_KEY)
+    line_length--;
+
+  row->size = line_length;
+  row->chars = line;
+  row->capacity = 0;
+  row->gap = line_length;
+  row->render_capacity = 0;
+  row->render_tabs = 0;
+  row->mapped = true;
+  row->in_arena = false;
+  row->render_size = 0;
+  row->render = NULL;
+  row->columns = NULL;
+  row->render_dirty = true;
+  row->render_entry = HL_UNKNOWN;
+  row->hl_state = HL_UNKNOWN;
+}
+
+// a slice of the file is scanned for newlines by one thread, after the
+// offsets of all slices are stitched together every slice builds a run of
+// row blocks from them
+struct load_slice {
+  pthread_t thread;
+  const char *map;
+  size_t start, end;
+  size_t *newlines;
+  size_t count, capacity;
+
+  const size_t *line_ends; // newline offsets of the whole range
+  size_t newline_count, range_start, range_end;
+  int lines;
+  row_block **blocks;
+  int first_block, end_block;
+  bool hash; // the blocks go into a sidecar, which keeps their hashes
+};
+
+// rows for a range of the file that starts a line and ends after a newline
+// or at the end of the file, ready to be spliced onto the tree
+struct load_batch {
+  row_block **blocks;
+  int block_count;
+  int lines;
+  struct load_batch *next;
+};
+
+// the file beyond the first screen is indexed on a thread in batches while
+// the editor runs, only the main thread splices them onto the end of the
+// tree so edits and lookups never see it change under them
+struct loader_state {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t batch_ready;
+  struct load_batch *head, *tail; // finished, not spliced yet
+  bool finished; // the thread queued its last batch
+  bool running; // the thread has not been joined
+  const char *map;
+  size_t start, size;
+  atomic_size_t indexed; // bytes handed over so far, for the status bar
+  int wake_fd; // eventfd bumped per batch, -1 without an event loop
+
+  // every spliced block, written to the sidecar index once the whole file
+  // is in, index_path is NULL when there is nothing to write
+  char *index_path;
+  struct stat index_stat; // of the file when it was opened
+  uint64_t *block_starts;
+  uint8_t *block_lines;
+  uint64_t *block_hashes;
+  size_t block_count, block_capacity;
+} LOADER = {.lock = PTHREAD_MUTEX_INITIALIZER,
+            .batch_ready = PTHREAD_COND_INITIALIZER,
+            .wake_fd = -1};
+
+// room for at least more further offsets
+void load_slice_reserve(struct load_slice *slice, size_t more) {
+  if (slice->capacity - slice->count >= more)
+    return;
+  slice->capacity = slice->capacity ? slice->capacity * 2 : 1024;
+  if (slice->capacity - slice->count < more)
+    slice->capacity = slice->count + more;
+  slice->newlines =
+      realloc(slice->newlines, slice->capacity * sizeof(*slice->newlines));
+  if (slice->newlines == NULL)
+    die("realloc");
+}
+
+// sixty four bytes are compared with the newline per step, every set bit
+// of the combined mask is a line end
+void *scan_newlines(void *arg) {
+  struct load_slice *slice = arg;
+  const char *map = slice->map;
+  size_t i = slice->start;
+#ifdef __SSE2__
+  __m128i newline = _mm_set1_epi8('\n');
+  for (; i + 64 <= slice->end; i += 64) {
+    uint64_t mask = 0;
+    for (int k = 0; k < 4; k++) {
+      __m128i bytes = _mm_loadu_si128((const __m128i *)&map[i + k * 16]);
+      mask |= (uint64_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline))
+              << (k * 16);
+    }
+    load_slice_reserve(slice, 64);
+    while (mask) {
+      slice->newlines[slice->count++] = i + __builtin_ctzll(mask);
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i < slice->end; i++) {
+    if (map[i] == '\n') {
+      load_slice_reserve(slice, 1);
+      slice->newlines[slice->count++] = i;
+    }
+  }
+  return NULL;
+}
+
+// every block starts paged out, its rows are split from the file on first
+// touch
+void *build_slice_rows(void *arg) {
+  struct load_slice *slice = arg;
+  for (int b = slice->first_block; b < slice->end_block; b++) {
+    int first = b * ROW_BLOCK_CAPACITY;
+    int last = (b + 1) * ROW_BLOCK_CAPACITY;
+    if (last > slice->lines)
+      last = slice->lines;
+    size_t start = first > 0 ? slice->line_ends[first - 1] + 1
+                             : slice->range_start;
+    size_t end = (size_t)last <= slice->newline_count
+                     ? slice->line_ends[last - 1] + 1
+                     : slice->range_end;
+    slice->blocks[b] = row_block_new_paged(&slice->map[start],
+                                           &slice->map[end], last - first);
+    if (slice->hash)
+      slice->blocks[b]->page_hash =
+          page_hash(slice->map, &slice->map[start], &slice->map[end]);
+  }
+  return NULL;
+}
+
+// runs work for every slice, all but the first on threads of their own
+void run_load_slices(struct load_slice *slices, int count,
+                     void *(*work)(void *)) {
+  for (int i = 1; i < count; i++) {
+    if (pthread_create(&slices[i].thread, NULL, work, &slices[i]) != 0)
+      die("pthread_create");
+  }
+  work(&slices[0]);
+  for (int i = 1; i < count; i++)
+    pthread_join(slices[i].thread, NULL);
+}
+
+// indexes map[start, end) on one slice per CPU, the newline offsets of the
+// slices are stitched into one array that the same slices then build their
+// share of the row blocks from
+struct load_batch *index_lines(const char *map, size_t start, size_t end) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > EDI_LOAD_THREADS)
+    threads = EDI_LOAD_THREADS;
+  if ((size_t)threads > (end - start) / EDI_LOAD_SLICE_MIN + 1)
+    threads = (end - start) / EDI_LOAD_SLICE_MIN + 1;
+  if (threads < 1)
+    threads = 1;
+
+  struct load_slice slices[EDI_LOAD_THREADS];
+  memset(slices, 0, sizeof(slices));
+  for (int t = 0; t < threads; t++) {
+    slices[t].map = map;
+    slices[t].start = start + (end - start) * t / threads;
+    slices[t].end = start + (end - start) * (t + 1) / threads;
+  }
+  run_load_slices(slices, threads, scan_newlines);
+
+  size_t newline_count = 0;
+  for (int t = 0; t < threads; t++)
+    newline_count += slices[t].count;
+  size_t *line_ends = malloc((newline_count + 1) * sizeof(*line_ends));
+  if (line_ends == NULL)
+    die("malloc");
+  size_t at = 0;
+  for (int t = 0; t < threads; t++) {
+    memcpy(&line_ends[at], slices[t].newlines,
+           slices[t].count * sizeof(*line_ends));
+    at += slices[t].count;
+    free(slices[t].newlines);
+  }
+
+  size_t lines = newline_count + (map[end - 1] != '\n');
+  if (lines > INT_MAX)
+    die("index_lines: too many lines");
+
+  struct load_batch *batch = calloc(1, sizeof(*batch));
+  if (batch == NULL)
+    die("calloc");
+  batch->lines = lines;
+  batch->block_count = (lines + ROW_BLOCK_CAPACITY - 1) / ROW_BLOCK_CAPACITY;
+  batch->blocks = malloc(sizeof(row_block *) * (batch->block_count + 1));
+  if (batch->blocks == NULL)
+    die("malloc");
+  for (int t = 0; t < threads; t++) {
+    slices[t].line_ends = line_ends;
+    slices[t].newline_count = newline_count;
+    slices[t].range_start = start;
+    slices[t].range_end = end;
+    slices[t].lines = lines;
+    slices[t].blocks = batch->blocks;
+    slices[t].first_block = (long)batch->block_count * t / threads;
+    slices[t].end_block = (long)batch->block_count * (t + 1) / threads;
+    slices[t].hash = LOADER.index_path != NULL;
+  }
+  run_load_slices(slices, threads, build_slice_rows);
+  free(line_ends);
+  return batch;
+}
+
+// where the batch starting at start ends, just after a newline
+size_t load_batch_end(const char *map, size_t start, size_t size,
+                      size_t length) {
+  if (size - start <= length)
+    return size;
+  const char *newline =
+      memchr(&map[start + length], '\n', size - start - length);
+  return newline ? (size_t)(newline - map) + 1 : size;
+}
+
+void record_load_batch(struct load_batch *batch) {
+  if (LOADER.block_capacity - LOADER.block_count < (size_t)batch->block_count) {
+    LOADER.block_capacity = LOADER.block_count + batch->block_count +
+                            LOADER.block_capacity;
+    LOADER.block_starts = realloc(LOADER.block_starts,
+                                  LOADER.block_capacity * sizeof(uint64_t));
+    LOADER.block_lines = realloc(LOADER.block_lines, LOADER.block_capacity);
+    LOADER.block_hashes = realloc(LOADER.block_hashes,
+                                  LOADER.block_capacity * sizeof(uint64_t));
+    if (LOADER.block_starts == NULL || LOADER.block_lines == NULL ||
+        LOADER.block_hashes == NULL)
+      die("realloc");
+  }
+  for (int b = 0; b < batch->block_count; b++) {
+    LOADER.block_starts[LOADER.block_count] =
+        batch->blocks[b]->page_start - LOADER.map;
+    LOADER.block_lines[LOADER.block_count] = batch->blocks[b]->size;
+    LOADER.block_hashes[LOADER.block_count] = batch->blocks[b]->page_hash;
+    LOADER.block_count++;
+  }
+}
+
+void splice_load_batch(struct load_batch *batch) {
+  if (batch->lines > INT_MAX - EDITOR.number_of_rows)
+    die("splice_load_batch: too many lines");
+  if (LOADER.index_path)
+    record_load_batch(batch);
+  row_block *rows = row_block_build(batch->blocks, batch->block_count);
+  EDITOR.rows = row_block_merge(EDITOR.rows, rows);
+  EDITOR.number_of_rows += batch->lines;
+  free(batch->blocks);
+  free(batch);
+}
+
+// the sidecar index of a large file holds the start, line count and hash of
+// every block up to the last complete one, it is used while the file keeps
+// its size and mtime or grows with the hashed ends of the indexed part
+// intact, and every block is still checked against its hash on first touch
+struct line_index_header {
+  char magic[8];
+  uint64_t size;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t checksum;
+  uint64_t indexed_end; // end of the last block, just after a newline
+  uint64_t block_count;
+};
+
+#define LINE_INDEX_MAGIC "edi-idx2"
+
+uint64_t hash_bytes(uint64_t hash, const char *data, size_t length) {
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+// hashes the first and the last bytes before end, hashing all of a large
+// file would cost as much as scanning it
+uint64_t line_index_checksum(const char *map, size_t end) {
+  size_t head = end < EDI_INDEX_CHECK_SIZE ? end : EDI_INDEX_CHECK_SIZE;
+  uint64_t hash = hash_bytes(0xcbf29ce484222325ULL, map, head);
+  return hash_bytes(hash, &map[end - head], head);
+}
+
+// the sidecar of filename in the edi cache directory, named after a hash of
+// the absolute path, NULL when there is no place for it
+char *line_index_path(const char *filename) {
+  char *absolute = realpath(filename, NULL);
+  if (absolute == NULL)
+    return NULL;
+  uint64_t name = hash_bytes(0xcbf29ce484222325ULL, absolute, strlen(absolute));
+  free(absolute);
+
+  char directory[PATH_MAX];
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (cache && cache[0] != '\0')
+    snprintf(directory, sizeof(directory), "%s", cache);
+  else if (home && home[0] != '\0')
+    snprintf(directory, sizeof(directory), "%s/.cache", home);
+  else
+    return NULL;
+  mkdir(directory, 0700);
+  strncat(directory, "/edi", sizeof(directory) - strlen(directory) - 1);
+  if (mkdir(directory, 0700) == -1 && errno != EEXIST)
+    return NULL;
+
+  size_t length = strlen(directory) + sizeof("/0123456789abcdef.index");
+  char *path = malloc(length);
+  snprintf(path, length, "%s/%016llx.index", directory,
+           (unsigned long long)name);
+  return path;
+}
+
+// paged blocks for the part of the file the sidecar at path covers, sets
+// *indexed to the end of that part and *current when the sidecar needs no
+// update, NULL when there is no valid sidecar
+struct load_batch *read_line_index(const char *path, const char *map,
+                                   struct stat *st, size_t *indexed,
+                                   bool *current) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  struct line_index_header header;
+  bool valid =
+      fread(&header, sizeof(header), 1, file) == 1 &&
+      memcmp(header.magic, LINE_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+      header.size <= (uint64_t)st->st_size &&
+      header.indexed_end <= header.size && header.block_count > 0 &&
+      header.block_count <= header.indexed_end &&
+      header.block_count <= INT_MAX / ROW_BLOCK_CAPACITY;
+  if (valid) {
+    *current = header.size == (uint64_t)st->st_size &&
+               header.mtime_sec == st->st_mtim.tv_sec &&
+               header.mtime_nsec == st->st_mtim.tv_nsec;
+    // a file of the same size with another mtime was rewritten in place
+    // the bytes after the indexed part are scanned as lines of their own
+    valid = (*current || header.size < (uint64_t)st->st_size) &&
+            map[header.indexed_end - 1] == '\n' &&
+            line_index_checksum(map, header.indexed_end) == header.checksum;
+  }
+
+  size_t count = valid ? header.block_count : 0;
+  uint64_t *starts = malloc(count * sizeof(*starts) + 1);
+  uint8_t *lines = malloc(count + 1);
+  uint64_t *hashes = malloc(count * sizeof(*hashes) + 1);
+  if (starts == NULL || lines == NULL || hashes == NULL)
+    die("malloc");
+  valid = valid && fread(starts, sizeof(*starts), count, file) == count &&
+          fread(lines, 1, count, file) == count &&
+          fread(hashes, sizeof(*hashes), count, file) == count &&
+          starts[0] == 0;
+  for (size_t b = 0; valid && b < count; b++) {
+    uint64_t end = b + 1 < count ? starts[b + 1] : header.indexed_end;
+    valid = starts[b] < end && lines[b] > 0 && lines[b] <= ROW_BLOCK_CAPACITY;
+  }
+  fclose(file);
+
+  struct load_batch *batch = NULL;
+  if (valid) {
+    batch = calloc(1, sizeof(*batch));
+    if (batch == NULL)
+      die("calloc");
+    batch->blocks = malloc(sizeof(row_block *) * count);
+    if (batch->blocks == NULL)
+      die("malloc");
+    batch->block_count = count;
+    for (size_t b = 0; b < count; b++) {
+      uint64_t end = b + 1 < count ? starts[b + 1] : header.indexed_end;
+      batch->blocks[b] =
+          row_block_new_paged(&map[starts[b]], &map[end], lines[b]);
+      batch->blocks[b]->page_hash = hashes[b];
+      batch->blocks[b]->page_unchecked = true;
+      batch->lines += lines[b];
+    }
+    *indexed = header.indexed_end;
+  }
+  free(starts);
+  free(lines);
+  free(hashes);
+  return batch;
+}
+
+// writes the blocks spliced while loading to the sidecar, the last block is
+// left out when the file does not end with a newline as appending to the
+// file extends its last line
+void write_line_index() {
+  char *path = LOADER.index_path;
+  if (path == NULL)
+    return;
+  LOADER.index_path = NULL;
+
+  size_t count = LOADER.block_count;
+  const char *map = LOADER.map;
+  size_t size = LOADER.index_stat.st_size;
+  if (count > 0 && map[size - 1] != '\n')
+    count--;
+  size_t indexed_end = count < LOADER.block_count
+                           ? LOADER.block_starts[count]
+                           : size;
+
+  struct line_index_header header = {
+      .size = size,
+      .mtime_sec = LOADER.index_stat.st_mtim.tv_sec,
+      .mtime_nsec = LOADER.index_stat.st_mtim.tv_nsec,
+      .checksum = line_index_checksum(map, indexed_end),
+      .indexed_end = indexed_end,
+      .block_count = count};
+  memcpy(header.magic, LINE_INDEX_MAGIC, sizeof(header.magic));
+
+  size_t template_length = strlen(path) + sizeof(".XXXXXX");
+  char *temporary = malloc(template_length);
+  snprintf(temporary, template_length, "%s.XXXXXX", path);
+  int fd = count > 0 ? mkstemp(temporary) : -1;
+  if (fd != -1) {
+    FILE *file = fdopen(fd, "wb");
+    bool written =
+        file && fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(LOADER.block_starts, sizeof(uint64_t), count, file) == count &&
+        fwrite(LOADER.block_lines, 1, count, file) == count &&
+        fwrite(LOADER.block_hashes, sizeof(uint64_t), count, file) == count;
+    if (file ? fclose(file) != 0 : close(fd) != 0)
+      written = false;
+    if (!written || rename(temporary, path) == -1)
+      unlink(temporary);
+  }
+
+  free(temporary);
+  free(path);
+  free(LOADER.block_starts);
+  free(LOADER.block_lines);
+  free(LOADER.block_hashes);
+  LOADER.block_starts = NULL;
+  LOADER.block_lines = NULL;
+  LOADER.block_hashes = NULL;
+  LOADER.block_count = LOADER.block_capacity = 0;
+}
+
+void *load_worker(void *unused) {
+  (void)unused;
+  size_t position = LOADER.start;
+  while (position < LOADER.size) {
+    size_t end = load_batch_end(LOADER.map, position, LOADER.size,
+                                EDI_LOAD_BATCH_SIZE);
+    struct load_batch *batch = index_lines(LOADER.map, position, end);
+
+    pthread_mutex_lock(&LOADER.lock);
+    if (LOADER.tail)
+      LOADER.tail->next = batch;
+    else
+      LOADER.head = batch;
+    LOADER.tail = batch;
+    if (end == LOADER.size)
+      LOADER.finished = true;
+    pthread_cond_signal(&LOADER.batch_ready);
+    pthread_mutex_unlock(&LOADER.lock);
+
+    atomic_store(&LOADER.indexed, end);
+    if (LOADER.wake_fd != -1) {
+      uint64_t one = 1;
+      write(LOADER.wake_fd, &one, sizeof(one));
+    }
+    position = end;
+  }
+  return NULL;
+}
+
+// moves the finished batches onto the end of the tree and joins the loader
+// once it queued the last one
+void load_splice() {
+  if (!LOADER.running)
+    return;
+  pthread_mutex_lock(&LOADER.lock);
+  struct load_batch *batch = LOADER.head;
+  bool finished = LOADER.finished;
+  LOADER.head = LOADER.tail = NULL;
+  pthread_mutex_unlock(&LOADER.lock);
+
+  while (batch) {
+    struct load_batch *next = batch->next;
+    splice_load_batch(batch);
+    batch = next;
+  }
+  if (finished) {
+    pthread_join(LOADER.thread, NULL);
+    LOADER.running = false;
+    write_line_index();
+  }
+}
+
+// blocks until at least rows rows exist or the whole file is in
+void load_wait_rows(int rows) {
+  while (LOADER.running && EDITOR.number_of_rows < rows) {
+    pthread_mutex_lock(&LOADER.lock);
+    while (LOADER.head == NULL)
+      pthread_cond_wait(&LOADER.batch_ready, &LOADER.lock);
+    pthread_mutex_unlock(&LOADER.lock);
+    load_splice();
+  }
+}
+
+void load_finish() { load_wait_rows(INT_MAX); }
+
+// the percentage of the file loaded, 100 once every row is in the tree
+int load_progress() {
+  if (!LOADER.running)
+    return 100;
+  return atomic_load(&LOADER.indexed) * 100 / LOADER.size;
+}
+
+// maps the file and builds the rows of its first batch right away, the rest
+// follows from the loader thread, a large file starts from its sidecar index
+// and only the part the sidecar does not cover is scanned
+bool map_file(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return false;
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return false;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  size_t size = st.st_size;
+
+  EDITOR.file_map = map;
+  EDITOR.file_map_size = size;
+  EDITOR.file_fd = fd; // kept open as the source for copy_file_range
+
+  LOADER.map = map;
+  LOADER.size = size;
+  size_t indexed = 0;
+  if (size >= EDI_INDEX_CACHE_MIN && EDITOR.filename)
+    LOADER.index_path = line_index_path(EDITOR.filename);
+  if (LOADER.index_path) {
+    LOADER.index_stat = st;
+    bool current = false;
+    struct load_batch *cached =
+        read_line_index(LOADER.index_path, map, &st, &indexed, &current);
+    if (cached)
+      splice_load_batch(cached);
+    if (current) {
+      free(LOADER.index_path);
+      LOADER.index_path = NULL;
+    }
+  }
+  if (indexed == size) {
+    write_line_index();
+    return true;
+  }
+
+  size_t first = load_batch_end(map, indexed, size, EDI_LOAD_FIRST_SIZE);
+  splice_load_batch(index_lines(map, indexed, first));
+  if (first == size) {
+    write_line_index();
+    return true;
+  }
+
+  LOADER.start = first;
+  LOADER.finished = false;
+  atomic_store(&LOADER.indexed, first);
+  if (pthread_create(&LOADER.thread, NULL, load_worker, NULL) != 0)
+    die("pthread_create");
+  LOADER.running = true;
+
+  // without an event loop nothing would splice the batches
+  if (LOADER.wake_fd == -1)
+    load_finish();
+  return true;
+}
+
+void open_file(char *filename) {
+  free(EDITOR.filename);
+  EDITOR.filename = strdup(filename);
+  select_syntax(filename);
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1)
+    die("open_file");
+
+  if (map_file(fd)) {
+    EDITOR.file_modified = false;
+    return;
+  }
+
+  FILE *file = fdopen(fd, "r");
+  if (!file)
+    die("open_file");
+
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t line_length;
+
+  while ((line_length = getline(&line, &line_cap, file)) != -1) {
+    while (line_length > 0 && (line[line_length - 1] == ENTER_KEY ||
+                               line[line_length - 1] == '\n'))
+      line_length--;
+    init_arena_row(row_tree_insert(EDITOR.number_of_rows), line, line_length);
+  }
+
+  free(line);
+  fclose(file);
+
+  EDITOR.file_modified = false;
+}
+
+// batches row writes into iovecs and hands runs of unmodified mapped rows
+// to copy_file_range so their bytes never pass through user space
+struct save_stream {
+  int fd;
+  struct iovec iov[EDI_SAVE_IOVECS];
+  int iov_count;
+  off_t copy_start; // run of the original file still to be copied
+  size_t copy_length;
+  size_t written;
+  bool failed;
+};
+
+void save_stream_flush(struct save_stream *stream) {
+  struct iovec *iov = stream->iov;
+  int count = stream->iov_count;
+  stream->iov_count = 0;
+  while (count > 0 && !stream->failed) {
+    ssize_t written = writev(stream->fd, iov, count);
+    if (written == -1) {
+      if (errno != EINTR)
+        stream->failed = true;
+      continue;
+    }
+    stream->written += written;
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+}
+
+void save_stream_write(struct save_stream *stream, const char *data,
+                       size_t length) {
+  if (length == 0)
+    return;
+  if (stream->iov_count == EDI_SAVE_IOVECS)
+    save_stream_flush(stream);
+  stream->iov[stream->iov_count].iov_base = (void *)data;
+  stream->iov[stream->iov_count].iov_len = length;
+  stream->iov_count++;
+}
+
+void save_stream_copy_run(struct save_stream *stream) {
+  if (stream->copy_length == 0)
+    return;
+
+  off_t start = stream->copy_start;
+  size_t length = stream->copy_length;
+  stream->copy_length = 0;
+  if (length >= EDI_SAVE_COPY_MIN) {
+    save_stream_flush(stream);
+    while (length > 0 && !stream->failed) {
+      ssize_t copied =
+          copy_file_range(EDITOR.file_fd, &start, stream->fd, NULL, length, 0);
+      if (copied <= 0)
+        break; // not supported here, write the rest from the mapping
+      length -= copied;
+      stream->written += copied;
+    }
+  }
+  save_stream_write(stream, &EDITOR.file_map[start], length);
+}
+
+// bytes of the file that go out unchanged extend the run to copy
+void save_stream_span(struct save_stream *stream, const char *start,
+                      size_t length) {
+  off_t offset = start - EDITOR.file_map;
+  if (stream->copy_length > 0 &&
+      stream->copy_start + (off_t)stream->copy_length != offset)
+    save_stream_copy_run(stream);
+  if (stream->copy_length == 0)
+    stream->copy_start = offset;
+  stream->copy_length += length;
+}
+
+void save_stream_row(struct save_stream *stream, editor_row *row) {
+  if (row->mapped) {
+    // a mapped row followed by its newline in the file extends the run
+    off_t offset = row->chars - EDITOR.file_map;
+    if ((size_t)offset + row->size < EDITOR.file_map_size &&
+        row->chars[row->size] == '\n') {
+      save_stream_span(stream, row->chars, row->size + 1);
+      return;
+    }
+  }
+
+  save_stream_copy_run(stream);
+  if (row->mapped) {
+    save_stream_write(stream, row->chars, row->size);
+  } else {
+    // both halves of the gap buffer go out as they are
+    save_stream_write(stream, row->chars, row->gap);
+    save_stream_write(stream,
+                      &row->chars[row->gap + row->capacity - row->size],
+                      row->size - row->gap);
+  }
+  save_stream_write(stream, "\n", 1);
+}
+
+// the file path names with symlinks resolved, so that a save through a link
+// updates its target, path itself when it does not exist yet
+char *resolve_path(const char *path) {
+  char *resolved = realpath(path, NULL);
+  return resolved ? resolved : strdup(path);
+}
+
+// syncs the directory holding path so that a rename into it survives a
+// crash
+void sync_directory(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *directory = slash ? strndup(path, slash - path + 1) : strdup(".");
+  int fd = open(directory, O_RDONLY | O_DIRECTORY);
+  if (fd != -1) {
+    fsync(fd);
+    close(fd);
+  }
+  free(directory);
+}
+
+// the replaced file keeps its owner, only root may hand a file to another
+// user so the group alone is tried next, failing both leaves it ours
+void keep_owner(int fd, struct stat *st) {
+  if (fchown(fd, st->st_uid, st->st_gid) == -1 &&
+      fchown(fd, -1, st->st_gid) == -1)
+    return;
+}
+
+// streams the document into a temporary file with mode next to path and
+// syncs it, the file is renamed over path when replace is set and unlinked
+// otherwise, returns it open or -1 with errno set
+int write_document(const char *path, mode_t mode, bool replace,
+                   size_t *length) {
+  load_finish(); // rows still loading are part of the document
+  size_t template_length = strlen(path) + sizeof(".XXXXXX");
+  char *temporary = malloc(template_length);
+  snprintf(temporary, template_length, "%s.XXXXXX", path);
+
+  struct save_stream stream = {0};
+  stream.fd = mkstemp(temporary);
+  if (stream.fd == -1) {
+    free(temporary);
+    return -1;
+  }
+
+  fchmod(stream.fd, mode);
+  struct stat st;
+  if (replace && stat(path, &st) == 0)
+    keep_owner(stream.fd, &st);
+
+  // paged out blocks go out as their bytes without being paged in
+  editor_row *row;
+  row_block *page;
+  row_iterator it = row_iterator_at(0);
+  while (!stream.failed) {
+    if ((page = row_iterator_page(&it)) && page_is_saved_as_is(page)) {
+      save_stream_span(&stream, page->page_start,
+                       page->page_end - page->page_start);
+      it.index = page->size;
+    } else if ((row = row_iterator_next(&it))) {
+      save_stream_row(&stream, row);
+    } else {
+      break;
+    }
+  }
+  save_stream_copy_run(&stream);
+  save_stream_flush(&stream);
+
+  if (stream.failed || fsync(stream.fd) == -1 ||
+      (replace && rename(temporary, path) == -1)) {
+    int saved_errno = errno;
+    close(stream.fd);
+    unlink(temporary);
+    free(temporary);
+    errno = saved_errno;
+    return -1;
+  }
+
+  if (replace)
+    sync_directory(path);
+  else
+    unlink(temporary);
+  free(temporary);
+  *length = stream.written;
+  return stream.fd;
+}
+
+// copies length bytes of the saved document in fd over path in place, which
+// keeps every hard link of path pointing at the new text
+int write_in_place(int fd, const char *path, size_t length) {
+  int out = open(path, O_WRONLY | O_TRUNC);
+  if (out == -1)
+    return -1;
+  off_t offset = 0;
+  char buffer[64 * 1024];
+  while ((size_t)offset < length) {
+    ssize_t copied =
+        copy_file_range(fd, &offset, out, NULL, length - offset, 0);
+    if (copied > 0)
+      continue;
+    // not supported here, copy the rest through a buffer
+    ssize_t got = pread(fd, buffer, sizeof(buffer), offset);
+    if (got <= 0 || write(out, buffer, got) != got) {
+      int saved_errno = got == 0 ? EIO : errno;
+      close(out);
+      errno = saved_errno;
+      return -1;
+    }
+    offset += got;
+  }
+  if (fsync(out) == -1) {
+    int saved_errno = errno;
+    close(out);
+    errno = saved_errno;
+    return -1;
+  }
+  return close(out);
+}
+
+char *autosave_path() {
+  size_t length = strlen(EDITOR.filename) + sizeof(".autosave");
+  char *path = malloc(length);
+  snprintf(path, length, "%s.autosave", EDITOR.filename);
+  return path;
+}
+
+// writes unsaved changes next to the file, the real file is left alone
+void autosave() {
+  EDITOR.autosave_deadline = 0;
+  if (!EDITOR.file_modified || EDITOR.filename == NULL)
+    return;
+
+  size_t length;
+  char *path = autosave_path();
+  char *target = resolve_path(path);
+  // the unsaved text is for the user alone whatever the file allows
+  int fd = write_document(target, 0600, true, &length);
+  if (fd == -1)
+    set_status_message("Autosave failed: %s", strerror(errno));
+  else
+    close(fd);
+  free(target);
+  free(path);
+}
+
+void remove_autosave() {
+  if (EDITOR.filename == NULL)
+    return;
+  char *path = autosave_path();
+  unlink(path);
+  free(path);
+  EDITOR.autosave_deadline = 0;
+}
+
+void save_file() {
+  if (EDITOR.filename == NULL) {
+    EDITOR.filename = editor_prompt("Save as: %s", NULL, false);
+    if (EDITOR.filename == NULL) {
+      set_status_message("Saving aborted...");
+      return;
+    }
+    select_syntax(EDITOR.filename);
+  }
+
+  char *target = resolve_path(EDITOR.filename);
+  struct stat st;
+  mode_t mode;
+  bool exists = stat(target, &st) == 0;
+  if (exists) {
+    mode = st.st_mode & 07777;
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    mode = 0644 & ~mask;
+  }
+  // a rename would leave the other names of a hard linked file on the old
+  // text, so such a file is written over in place
+  bool in_place = exists && st.st_nlink > 1;
+
+  size_t length;
+  int fd = write_document(target, mode, !in_place, &length);
+  if (fd == -1) {
+    set_status_message("Error while saving: %s", strerror(errno));
+    free(target);
+    return;
+  }
+
+  // the old mapping keeps the replaced file alive, move the rows onto the
+  // new one so edited rows drop their private copies as well, a file saved
+  // in place is only written once no row points into it any more
+  find_all_wait();
+  char *map = length == 0
+                  ? MAP_FAILED
+                  : mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED)
+    rebase_rows(fd, map, length);
+  bool failed = in_place && ((map == MAP_FAILED && length > 0) ||
+                             write_in_place(fd, target, length) == -1);
+  int saved_errno = errno;
+  if (map == MAP_FAILED)
+    close(fd);
+  free(target);
+  if (failed) {
+    set_status_message("Error while saving: %s", strerror(saved_errno));
+    return;
+  }
+  follow_saved(length);
+
+  EDITOR.file_modified = false;
+  remove_autosave();
+  set_status_message("%zu bytes written to disk", length);
+}
+
+/* follow */
+
+// follow mode appends whatever is written to the end of the file while it
+// is open, an inotify watch on the file and one on its directory wake the
+// event loop, which costs nothing while the file is quiet
+struct follow_state {
+  int inotify_fd; // -1 while not following
+  int file_watch, directory_watch;
+  int fd; // the file being followed, reopened when the path is rotated
+  dev_t device;
+  ino_t inode;
+  off_t offset; // bytes of it already in the document
+  bool partial; // the last row is a line that has not ended yet
+} FOLLOW = {.inotify_fd = -1, .fd = -1};
+
+// whole lines go in through the bulk row path, the first bytes continue the
+// last row while its line has not ended
+void follow_append(const char *text, size_t length) {
+  find_all_wait();
+  highlight_edited(EDITOR.number_of_rows - 1);
+  const char *p = text, *end = text + length;
+  if (FOLLOW.partial && EDITOR.number_of_rows > 0) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *line_end = newline ? newline : end;
+    editor_row *row = row_at(EDITOR.number_of_rows - 1);
+    insert_string_in_row(row, row->size, p, line_end - p);
+    if (newline) {
+      int size = row->size;
+      while (size > 0 && row_char(row, size - 1) == ENTER_KEY)
+        size--;
+      truncate_row(row, size);
+    }
+    FOLLOW.partial = newline == NULL;
+    p = newline ? newline + 1 : end;
+  }
+
+  int capacity = 64;
+  int count = 0;
+  editor_row *rows = malloc(sizeof(editor_row) * capacity);
+  while (p < end) {
+    const char *newline = memchr(p, '\n', end - p);
+    const char *line_end = newline ? newline : end;
+    int line_length = line_end - p;
+    while (newline && line_length > 0 && p[line_length - 1] == ENTER_KEY)
+      line_length--;
+
+    if (count == capacity) {
+      capacity *= 2;
+      rows = realloc(rows, sizeof(editor_row) * capacity);
+    }
+    init_arena_row(&rows[count++], p, line_length);
+    FOLLOW.partial = newline == NULL;
+    p = newline ? newline + 1 : end;
+  }
+  row_tree_insert_rows(EDITOR.number_of_rows, rows, count);
+  free(rows);
+}
+
+// reads what was written since the last read, a cursor on the last row
+// stays on the last row so the view scrolls along
+void follow_read() {
+  char buffer[EDI_FOLLOW_CHUNK];
+  bool at_bottom = EDITOR.cursor_y >= EDITOR.number_of_rows - 1;
+  bool modified = EDITOR.file_modified;
+  int rows = EDITOR.number_of_rows;
+  ssize_t length;
+  while ((length = pread(FOLLOW.fd, buffer, sizeof(buffer), FOLLOW.offset)) >
+         0) {
+    follow_append(buffer, length);
+    FOLLOW.offset += length;
+  }
+  EDITOR.file_modified = modified; // the rows are in the file already
+
+  if (at_bottom && EDITOR.number_of_rows > rows) {
+    EDITOR.cursor_y = EDITOR.number_of_rows - 1;
+    EDITOR.cursor_x = 0;
+  }
+}
+
+// starts reading fd, a file that offset bytes of are in the document
+void follow_switch(int fd, off_t offset) {
+  struct stat st;
+  fstat(fd, &st);
+  if (FOLLOW.fd != -1)
+    close(FOLLOW.fd);
+  FOLLOW.fd = fd;
+  FOLLOW.device = st.st_dev;
+  FOLLOW.inode = st.st_ino;
+  FOLLOW.offset = offset;
+  FOLLOW.partial = false;
+
+  inotify_rm_watch(FOLLOW.inotify_fd, FOLLOW.file_watch);
+  FOLLOW.file_watch =
+      inotify_add_watch(FOLLOW.inotify_fd, EDITOR.filename,
+                        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+// brings the document up to date with the followed path, a path that names
+// another file now was rotated and the old file is read to its end first, a
+// file shorter than what was read was truncated and is read from its start,
+// either way the rows read so far stay
+void follow_update() {
+  struct stat st;
+  if (stat(EDITOR.filename, &st) == 0 &&
+      (st.st_dev != FOLLOW.device || st.st_ino != FOLLOW.inode)) {
+    follow_read();
+    int fd = open(EDITOR.filename, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+      follow_switch(fd, 0);
+      set_status_message("%s was rotated, following the new file",
+                         EDITOR.filename);
+    }
+  }
+  if (fstat(FOLLOW.fd, &st) == 0 && st.st_size < FOLLOW.offset) {
+    FOLLOW.offset = 0;
+    FOLLOW.partial = false;
+    set_status_message("%s was truncated, following from its start",
+                       EDITOR.filename);
+  }
+  follow_read();
+}
+
+void follow_stop() {
+  if (FOLLOW.inotify_fd == -1)
+    return;
+  close(FOLLOW.inotify_fd);
+  close(FOLLOW.fd);
+  FOLLOW.inotify_fd = -1;
+  FOLLOW.fd = -1;
+}
+
+// the document holds the file as it was mapped, anything beyond that is
+// appended right away
+void follow_start() {
+  if (EDITOR.filename == NULL) {
+    set_status_message("Follow needs a file");
+    return;
+  }
+  load_finish();
+  int fd = open(EDITOR.filename, O_RDONLY | O_CLOEXEC);
+  FOLLOW.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd == -1 || FOLLOW.inotify_fd == -1) {
+    set_status_message("Cannot follow %s: %s", EDITOR.filename,
+                       strerror(errno));
+    if (fd != -1)
+      close(fd);
+    if (FOLLOW.inotify_fd != -1)
+      close(FOLLOW.inotify_fd);
+    FOLLOW.inotify_fd = -1;
+    return;
+  }
+
+  struct stat st, mapped;
+  fstat(fd, &st);
+  bool same = EDITOR.file_map && fstat(EDITOR.file_fd, &mapped) == 0 &&
+              mapped.st_dev == st.st_dev && mapped.st_ino == st.st_ino;
+  FOLLOW.file_watch = -1;
+  follow_switch(fd, same ? (off_t)EDITOR.file_map_size : 0);
+  FOLLOW.partial = same && EDITOR.file_map[EDITOR.file_map_size - 1] != '\n';
+
+  // rotation replaces the file, which only the directory sees
+  char *directory = strdup(EDITOR.filename);
+  char *slash = strrchr(directory, '/');
+  if (slash)
+    slash[slash == directory] = '\0';
+  FOLLOW.directory_watch =
+      inotify_add_watch(FOLLOW.inotify_fd, slash ? directory : ".",
+                        IN_CREATE | IN_MOVED_TO);
+  free(directory);
+  follow_update();
+}
+
+// a save replaced the followed file with the document itself
+void follow_saved(size_t length) {
+  if (FOLLOW.inotify_fd == -1)
+    return;
+  int fd = open(EDITOR.filename, O_RDONLY | O_CLOEXEC);
+  if (fd != -1)
+    follow_switch(fd, length);
+}
+
+void toggle_follow() {
+  if (FOLLOW.inotify_fd != -1) {
+    follow_stop();
+    set_status_message("Stopped following %s", EDITOR.filename);
+  } else {
+    follow_start();
+  }
+}
+
+/* regex */
+
+// a pattern is parsed into a tree and compiled to a program for a Pike VM,
+// which finds the leftmost match and its groups in time linear in the row,
+// a DFA over sets of program counters is built lazily from the same program
+// and answers in one pass over the row whether there is a match at all, so
+// rows without one never reach the VM
+enum regex_op {
+  RE_CLASS,
+  RE_MATCH,
+  RE_JUMP,
+  RE_SPLIT,
+  RE_SAVE,
+  RE_BOL,
+  RE_EOL
+};
+
+struct regex_inst {
+  enum regex_op op;
+  int x, y; // jump targets, the class or the capture slot
+};
+
+enum regex_node_type {
+  RN_EMPTY,
+  RN_CLASS,
+  RN_BOL,
+  RN_EOL,
+  RN_GROUP,
+  RN_CONCAT,
+  RN_ALTERNATE,
+  RN_STAR,
+  RN_PLUS,
+  RN_QUESTION
+};
+
+struct regex_node {
+  enum regex_node_type type;
+  int left, right;
+  int value; // class or group number
+};
+
+struct dfa_state {
+  int *pcs; // sorted, only instructions that wait for a byte or the end
+  int count;
+  unsigned int hash;
+  bool accept;
+  int next[256]; // -1 until the transition is first taken
+};
+
+struct pike_list {
+  int count;
+  int *pcs;
+  int *captures; // EDI_REGEX_GROUPS * 2 slots per thread
+};
+
+struct regex {
+  struct regex_inst *program;
+  int length, capacity;
+  unsigned char (*classes)[32];
+  int class_count;
+  int groups; // including group 0, the whole match
+
+  const char *at; // parser position
+  const char *error;
+  bool ignore_case;
+  struct regex_node *nodes;
+  int node_count, node_capacity;
+
+  struct dfa_state *states;
+  int state_count;
+  int *table; // open addressing index of states by their pc set
+  int start[2]; // start state inside a row and at its beginning, -1 unknown
+  int flushes;
+
+  int *set, *stack;
+  unsigned int *marks;
+  unsigned int generation;
+  struct pike_list lists[2];
+  int captures[EDI_REGEX_GROUPS * 2];
+};
+
+void regex_class_add(unsigned char *set, int c, bool ignore_case) {
+  set[c / 8] |= 1 << (c % 8);
+  if (ignore_case && isalpha(c)) {
+    int other = islower(c) ? toupper(c) : tolower(c);
+    set[other / 8] |= 1 << (other % 8);
+  }
+}
+
+bool regex_class_has(unsigned char *set, unsigned char c) {
+  return set[c / 8] & (1 << (c % 8));
+}
+
+int regex_new_class(struct regex *re) {
+  re->classes = realloc(re->classes, (re->class_count + 1) * 32);
+  if (re->classes == NULL)
+    die("realloc");
+  memset(re->classes[re->class_count], 0, 32);
+  return re->class_count++;
+}
+
+int regex_new_node(struct regex *re, enum regex_node_type type, int left,
+                   int right, int value) {
+  if (re->node_count == re->node_capacity) {
+    re->node_capacity = re->node_capacity ? re->node_capacity * 2 : 16;
+    re->nodes = realloc(re->nodes, re->node_capacity * sizeof(*re->nodes));
+    if (re->nodes == NULL)
+      die("realloc");
+  }
+  struct regex_node *node = &re->nodes[re->node_count];
+  node->type = type;
+  node->left = left;
+  node->right = right;
+  node->value = value;
+  return re->node_count++;
+}
+
+// \d, \w and \s and their negations, false for any other escape
+bool regex_class_escape(unsigned char *set, char c) {
+  int (*test)(int);
+  switch (tolower((unsigned char)c)) {
+  case 'd':
+    test = isdigit;
+    break;
+  case 'w':
+    test = isalnum;
+    break;
+  case 's':
+    test = isspace;
+    break;
+  default:
+    return false;
+  }
+  bool negate = isupper((unsigned char)c);
+  for (int i = 0; i < 256; i++) {
+    bool in = test(i) || (tolower((unsigned char)c) == 'w' && i == '_');
+    if (in != negate)
+      set[i / 8] |= 1 << (i % 8);
+  }
+  return true;
+}
+
+char regex_escaped_char(char c) {
+  switch (c) {
+  case 't':
+    return '\t';
+  case 'r':
+    return '\r';
+  case 'n':
+    return '\n';
+  default:
+    return c;
+  }
+}
+
+// a bracket expression, the opening bracket was consumed
+int regex_parse_bracket(struct regex *re) {
+  int class_index = regex_new_class(re);
+  unsigned char *set = re->classes[class_index];
+  bool negate = *re->at == '^';
+  if (negate)
+    re->at++;
+
+  bool first = true;
+  while (*re->at != ']' || first) {
+    first = false;
+    if (*re->at == '\0') {
+      re->error = "missing ]";
+      return -1;
+    }
+    unsigned char low = *re->at++;
+    if (low == '\\') {
+      if (*re->at == '\0') {
+        re->error = "trailing \\";
+        return -1;
+      }
+      if (regex_class_escape(re->classes[class_index], *re->at)) {
+        re->at++;
+        continue;
+      }
+      low = regex_escaped_char(*re->at++);
+    }
+
+    unsigned char high = low;
+    if (re->at[0] == '-' && re->at[1] != ']' && re->at[1] != '\0') {
+      re->at++;
+      high = *re->at++;
+      if (high == '\\' && *re->at != '\0')
+        high = regex_escaped_char(*re->at++);
+      if (high < low) {
+        re->error = "bad range";
+        return -1;
+      }
+    }
+    set = re->classes[class_index];
+    for (int c = low; c <= high; c++)
+      regex_class_add(set, c, re->ignore_case);
+  }
+  re->at++;
+
+  set = re->classes[class_index];
+  if (negate) {
+    for (int i = 0; i < 32; i++)
+      set[i] = ~set[i];
+    set['\n' / 8] &= ~(1 << ('\n' % 8));
+  }
+  return regex_new_node(re, RN_CLASS, -1, -1, class_index);
+}
+
+int regex_parse_alternation(struct regex *re);
+
+int regex_parse_atom(struct regex *re) {
+  char c = *re->at++;
+  int class_index;
+  switch (c) {
+  case '(': {
+    if (re->groups == EDI_REGEX_GROUPS) {
+      re->error = "too many groups";
+      return -1;
+    }
+    int group = re->groups++;
+    int inner = regex_parse_alternation(re);
+    if (inner == -1)
+      return -1;
+    if (*re->at != ')') {
+      re->error = "missing )";
+      return -1;
+    }
+    re->at++;
+    return regex_new_node(re, RN_GROUP, inner, -1, group);
+  }
+  case '[':
+    return regex_parse_bracket(re);
+  case '^':
+    return regex_new_node(re, RN_BOL, -1, -1, 0);
+  case '$':
+    return regex_new_node(re, RN_EOL, -1, -1, 0);
+  case '*':
+  case '+':
+  case '?':
+    re->error = "nothing to repeat";
+    return -1;
+  case '.':
+    class_index = regex_new_class(re);
+    memset(re->classes[class_index], 0xff, 32);
+    re->classes[class_index]['\n' / 8] &= ~(1 << ('\n' % 8));
+    return regex_new_node(re, RN_CLASS, -1, -1, class_index);
+  case '\\':
+    if (*re->at == '\0') {
+      re->error = "trailing \\";
+      return -1;
+    }
+    class_index = regex_new_class(re);
+    if (!regex_class_escape(re->classes[class_index], *re->at))
+      regex_class_add(re->classes[class_index],
+                      (unsigned char)regex_escaped_char(*re->at),
+                      re->ignore_case);
+    re->at++;
+    return regex_new_node(re, RN_CLASS, -1, -1, class_index);
+  default:
+    class_index = regex_new_class(re);
+    regex_class_add(re->classes[class_index], (unsigned char)c,
+                    re->ignore_case);
+    return regex_new_node(re, RN_CLASS, -1, -1, class_index);
+  }
+}
+
+int regex_parse_repeat(struct regex *re) {
+  int node = regex_parse_atom(re);
+  while (node != -1 &&
+         (*re->at == '*' || *re->at == '+' || *re->at == '?')) {
+    char c = *re->at++;
+    enum regex_node_type type =
+        c == '*' ? RN_STAR : c == '+' ? RN_PLUS : RN_QUESTION;
+    node = regex_new_node(re, type, node, -1, 0);
+  }
+  return node;
+}
+
+int regex_parse_concat(struct regex *re) {
+  int node = regex_new_node(re, RN_EMPTY, -1, -1, 0);
+  while (*re->at != '\0' && *re->at != '|' && *re->at != ')') {
+    int next = regex_parse_repeat(re);
+    if (next == -1)
+      return -1;
+    node = regex_new_node(re, RN_CONCAT, node, next, 0);
+  }
+  return node;
+}
+
+int regex_parse_alternation(struct regex *re) {
+  int node = regex_parse_concat(re);
+  while (node != -1 && *re->at == '|') {
+    re->at++;
+    int next = regex_parse_concat(re);
+    if (next == -1)
+      return -1;
+    node = regex_new_node(re, RN_ALTERNATE, node, next, 0);
+  }
+  return node;
+}
+
+int regex_emit(struct regex *re, enum regex_op op, int x, int y) {
+  if (re->length == re->capacity) {
+    re->capacity = re->capacity ? re->capacity * 2 : 16;
+    re->program = realloc(re->program, re->capacity * sizeof(*re->program));
+    if (re->program == NULL)
+      die("realloc");
+  }
+  re->program[re->length].op = op;
+  re->program[re->length].x = x;
+  re->program[re->length].y = y;
+  return re->length++;
+}
+
+void regex_compile_node(struct regex *re, int index) {
+  struct regex_node node = re->nodes[index];
+  int split, jump, start;
+  switch (node.type) {
+  case RN_EMPTY:
+    break;
+  case RN_CLASS:
+    regex_emit(re, RE_CLASS, node.value, 0);
+    break;
+  case RN_BOL:
+    regex_emit(re, RE_BOL, 0, 0);
+    break;
+  case RN_EOL:
+    regex_emit(re, RE_EOL, 0, 0);
+    break;
+  case RN_GROUP:
+    regex_emit(re, RE_SAVE, node.value * 2, 0);
+    regex_compile_node(re, node.left);
+    regex_emit(re, RE_SAVE, node.value * 2 + 1, 0);
+    break;
+  case RN_CONCAT:
+    regex_compile_node(re, node.left);
+    regex_compile_node(re, node.right);
+    break;
+  case RN_ALTERNATE:
+    split = regex_emit(re, RE_SPLIT, re->length + 1, 0);
+    regex_compile_node(re, node.left);
+    jump = regex_emit(re, RE_JUMP, 0, 0);
+    re->program[split].y = re->length;
+    regex_compile_node(re, node.right);
+    re->program[jump].x = re->length;
+    break;
+  case RN_STAR:
+    split = regex_emit(re, RE_SPLIT, re->length + 1, 0);
+    regex_compile_node(re, node.left);
+    regex_emit(re, RE_JUMP, split, 0);
+    re->program[split].y = re->length;
+    break;
+  case RN_PLUS:
+    start = re->length;
+    regex_compile_node(re, node.left);
+    regex_emit(re, RE_SPLIT, start, re->length + 1);
+    break;
+  case RN_QUESTION:
+    split = regex_emit(re, RE_SPLIT, re->length + 1, 0);
+    regex_compile_node(re, node.left);
+    re->program[split].y = re->length;
+    break;
+  }
+}
+
+void regex_free(struct regex *re) {
+  if (re == NULL)
+    return;
+  for (int i = 0; i < re->state_count; i++)
+    free(re->states[i].pcs);
+  free(re->states);
+  free(re->table);
+  free(re->program);
+  free(re->classes);
+  free(re->nodes);
+  free(re->set);
+  free(re->stack);
+  free(re->marks);
+  for (int i = 0; i < 2; i++) {
+    free(re->lists[i].pcs);
+    free(re->lists[i].captures);
+  }
+  free(re);
+}
+
+// NULL with *error set when the pattern is malformed
+struct regex *regex_compile(const char *pattern, bool ignore_case,
+                            const char **error) {
+  struct regex *re = calloc(1, sizeof(*re));
+  if (re == NULL)
+    die("calloc");
+  re->at = pattern;
+  re->ignore_case = ignore_case;
+  re->groups = 1;
+
+  int root = regex_parse_alternation(re);
+  if (root != -1 && *re->at == ')')
+    re->error = "unmatched )";
+  if (root == -1 || re->error) {
+    *error = re->error;
+    regex_free(re);
+    return NULL;
+  }
+
+  regex_emit(re, RE_SAVE, 0, 0);
+  regex_compile_node(re, root);
+  regex_emit(re, RE_SAVE, 1, 0);
+  regex_emit(re, RE_MATCH, 0, 0);
+  free(re->nodes);
+  re->nodes = NULL;
+
+  re->states = malloc(EDI_DFA_STATES * sizeof(*re->states));
+  re->table = malloc(EDI_DFA_STATES * 2 * sizeof(*re->table));
+  re->set = malloc(re->length * sizeof(*re->set));
+  re->stack = malloc((re->length * 2 + 1) * sizeof(*re->stack));
+  re->marks = calloc(re->length, sizeof(*re->marks));
+  for (int i = 0; i < 2; i++) {
+    re->lists[i].pcs = malloc(re->length * sizeof(int));
+    re->lists[i].captures =
+        malloc(re->length * EDI_REGEX_GROUPS * 2 * sizeof(int));
+    if (re->lists[i].pcs == NULL || re->lists[i].captures == NULL)
+      die("malloc");
+  }
+  if (!re->states || !re->table || !re->set || !re->stack || !re->marks)
+    die("malloc");
+  memset(re->table, -1, EDI_DFA_STATES * 2 * sizeof(*re->table));
+  re->start[0] = re->start[1] = -1;
+  return re;
+}
+
+// adds pc and what it reaches without consuming a byte to re->set, at_end
+// lets $ through instead of keeping it as a pending instruction
+void dfa_closure(struct regex *re, int pc, bool at_start, bool at_end,
+                 int *count) {
+  int depth = 0;
+  re->stack[depth++] = pc;
+  while (depth > 0) {
+    pc = re->stack[--depth];
+    if (re->marks[pc] == re->generation)
+      continue;
+    re->marks[pc] = re->generation;
+
+    struct regex_inst *inst = &re->program[pc];
+    switch (inst->op) {
+    case RE_JUMP:
+      re->stack[depth++] = inst->x;
+      break;
+    case RE_SPLIT:
+      re->stack[depth++] = inst->y;
+      re->stack[depth++] = inst->x;
+      break;
+    case RE_SAVE:
+      re->stack[depth++] = pc + 1;
+      break;
+    case RE_BOL:
+      if (at_start)
+        re->stack[depth++] = pc + 1;
+      break;
+    case RE_EOL:
+      if (at_end)
+        re->stack[depth++] = pc + 1;
+      else
+        re->set[(*count)++] = pc;
+      break;
+    case RE_CLASS:
+    case RE_MATCH:
+      re->set[(*count)++] = pc;
+      break;
+    }
+  }
+}
+
+int compare_ints(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+void dfa_flush(struct regex *re) {
+  for (int i = 0; i < re->state_count; i++)
+    free(re->states[i].pcs);
+  re->state_count = 0;
+  memset(re->table, -1, EDI_DFA_STATES * 2 * sizeof(*re->table));
+  re->start[0] = re->start[1] = -1;
+  re->flushes++;
+}
+
+// the state for the pcs in re->set, a full cache is dropped and rebuilt
+int dfa_state_for_set(struct regex *re, int count) {
+  qsort(re->set, count, sizeof(*re->set), compare_ints);
+  unsigned int hash = 2166136261u;
+  for (int i = 0; i < count; i++)
+    hash = (hash ^ re->set[i]) * 16777619u;
+
+  int mask = EDI_DFA_STATES * 2 - 1;
+  int slot = hash & mask;
+  for (; re->table[slot] != -1; slot = (slot + 1) & mask) {
+    struct dfa_state *state = &re->states[re->table[slot]];
+    if (state->hash == hash && state->count == count &&
+        memcmp(state->pcs, re->set, count * sizeof(int)) == 0)
+      return re->table[slot];
+  }
+
+  if (re->state_count == EDI_DFA_STATES) {
+    dfa_flush(re);
+    return dfa_state_for_set(re, count);
+  }
+
+  struct dfa_state *state = &re->states[re->state_count];
+  state->pcs = malloc((count ? count : 1) * sizeof(int));
+  if (state->pcs == NULL)
+    die("malloc");
+  memcpy(state->pcs, re->set, count * sizeof(int));
+  state->count = count;
+  state->hash = hash;
+  state->accept = false;
+  for (int i = 0; i < count; i++) {
+    if (re->program[re->set[i]].op == RE_MATCH)
+      state->accept = true;
+  }
+  memset(state->next, -1, sizeof(state->next));
+  re->table[slot] = re->state_count;
+  return re->state_count++;
+}
+
+int dfa_start(struct regex *re, bool at_start) {
+  if (re->start[at_start] == -1) {
+    int count = 0;
+    re->generation++;
+    dfa_closure(re, 0, at_start, false, &count);
+    re->start[at_start] = dfa_state_for_set(re, count);
+  }
+  return re->start[at_start];
+}
+
+// a match may begin at every position, so the start pc joins every state
+int dfa_next(struct regex *re, int from, unsigned char c) {
+  struct dfa_state *state = &re->states[from];
+  if (state->next[c] != -1)
+    return state->next[c];
+
+  int count = 0;
+  re->generation++;
+  for (int i = 0; i < state->count; i++) {
+    struct regex_inst *inst = &re->program[state->pcs[i]];
+    if (inst->op == RE_CLASS && regex_class_has(re->classes[inst->x], c))
+      dfa_closure(re, state->pcs[i] + 1, false, false, &count);
+  }
+  dfa_closure(re, 0, false, false, &count);
+
+  int flushes = re->flushes;
+  int next = dfa_state_for_set(re, count);
+  if (re->flushes == flushes)
+    re->states[from].next[c] = next;
+  return next;
+}
+
+bool dfa_accepts_at_end(struct regex *re, int from, bool at_start) {
+  struct dfa_state *state = &re->states[from];
+  int count = 0;
+  re->generation++;
+  for (int i = 0; i < state->count; i++) {
+    if (re->program[state->pcs[i]].op == RE_EOL)
+      dfa_closure(re, state->pcs[i], at_start, true, &count);
+  }
+  for (int i = 0; i < count; i++) {
+    if (re->program[re->set[i]].op == RE_MATCH)
+      return true;
+  }
+  return false;
+}
+
+// whether a match starts anywhere at or after from
+bool regex_has_match(struct regex *re, const char *text, int length,
+                     int from) {
+  int state = dfa_start(re, from == 0);
+  for (int i = from; i < length; i++) {
+    struct dfa_state *current = &re->states[state];
+    if (current->accept)
+      return true;
+    state = current->next[(unsigned char)text[i]];
+    if (state == -1)
+      state = dfa_next(re, current - re->states, text[i]);
+  }
+  return re->states[state].accept ||
+         dfa_accepts_at_end(re, state, length == 0);
+}
+
+void pike_add(struct regex *re, struct pike_list *list, int pc,
+              int *captures, int length, int at) {
+  if (re->marks[pc] == re->generation)
+    return;
+  re->marks[pc] = re->generation;
+
+  struct regex_inst *inst = &re->program[pc];
+  switch (inst->op) {
+  case RE_JUMP:
+    pike_add(re, list, inst->x, captures, length, at);
+    break;
+  case RE_SPLIT:
+    pike_add(re, list, inst->x, captures, length, at);
+    pike_add(re, list, inst->y, captures, length, at);
+    break;
+  case RE_SAVE: {
+    int saved = captures[inst->x];
+    captures[inst->x] = at;
+    pike_add(re, list, pc + 1, captures, length, at);
+    captures[inst->x] = saved;
+  } break;
+  case RE_BOL:
+    if (at == 0)
+      pike_add(re, list, pc + 1, captures, length, at);
+    break;
+  case RE_EOL:
+    if (at == length)
+      pike_add(re, list, pc + 1, captures, length, at);
+    break;
+  case RE_CLASS:
+  case RE_MATCH:
+    list->pcs[list->count] = pc;
+    memcpy(&list->captures[list->count * re->groups * 2], captures,
+           re->groups * 2 * sizeof(int));
+    list->count++;
+    break;
+  }
+}
+
+// leftmost match starting at or after from, captures receives the start and
+// end of the match and of each group, -1 for groups that took no part
+bool regex_search(struct regex *re, const char *text, int length, int from,
+                  int *captures) {
+  if (!regex_has_match(re, text, length, from))
+    return false;
+
+  int slots = re->groups * 2;
+  struct pike_list *current = &re->lists[0], *next = &re->lists[1];
+  current->count = 0;
+  re->generation++;
+  bool matched = false;
+
+  for (int at = from; at <= length; at++) {
+    if (!matched) {
+      // threads started later have the lowest priority
+      for (int i = 0; i < slots; i++)
+        re->captures[i] = -1;
+      pike_add(re, current, 0, re->captures, length, at);
+    }
+    if (current->count == 0 && matched)
+      break;
+
+    re->generation++;
+    next->count = 0;
+    for (int i = 0; i < current->count; i++) {
+      int pc = current->pcs[i];
+      int *thread_captures = &current->captures[i * slots];
+      if (re->program[pc].op == RE_MATCH) {
+        matched = true;
+        memcpy(captures, thread_captures, slots * sizeof(int));
+        break; // the remaining threads have lower priority
+      }
+      if (at < length &&
+          regex_class_has(re->classes[re->program[pc].x], text[at]))
+        pike_add(re, next, pc + 1, thread_captures, length, at + 1);
+    }
+    struct pike_list *swap = current;
+    current = next;
+    next = swap;
+  }
+  return matched;
+}
+
+/* find */
+
+struct search_query {
+  const char *needle;
+  size_t length;
+  bool ignore_case;
+  struct regex *regex; // the needle compiled as a pattern, NULL for literals
+};
+
+int memcmp_query(const char *text, struct search_query *query) {
+  if (!query->ignore_case)
+    return memcmp(text, query->needle, query->length);
+  for (size_t i = 0; i < query->length; i++) {
+    if (tolower((unsigned char)text[i]) !=
+        tolower((unsigned char)query->needle[i]))
+      return 1;
+  }
+  return 0;
+}
+
+// first occurrence of the query in text, candidates are positions where
+// both the first and the last byte of the needle match, sixteen positions
+// are filtered per step with SSE2 and the rest is checked byte by byte
+const char *search_memory(const char *text, size_t length,
+                          struct search_query *query) {
+  size_t n = query->length;
+  if (n == 0 || n > length)
+    return NULL;
+
+  unsigned char first = query->needle[0];
+  unsigned char last = query->needle[n - 1];
+  unsigned char first_other = first, last_other = last;
+  if (query->ignore_case) {
+    first = tolower(first);
+    first_other = toupper(first);
+    last = tolower(last);
+    last_other = toupper(last);
+  }
+
+  size_t i = 0;
+  size_t end = length - n + 1; // candidate positions
+#ifdef __SSE2__
+  __m128i first_a = _mm_set1_epi8(first), first_b = _mm_set1_epi8(first_other);
+  __m128i last_a = _mm_set1_epi8(last), last_b = _mm_set1_epi8(last_other);
+  for (; i + 16 <= end; i += 16) {
+    __m128i head = _mm_loadu_si128((const __m128i *)&text[i]);
+    __m128i tail = _mm_loadu_si128((const __m128i *)&text[i + n - 1]);
+    __m128i head_match = _mm_or_si128(_mm_cmpeq_epi8(head, first_a),
+                                      _mm_cmpeq_epi8(head, first_b));
+    __m128i tail_match = _mm_or_si128(_mm_cmpeq_epi8(tail, last_a),
+                                      _mm_cmpeq_epi8(tail, last_b));
+    unsigned int mask =
+        _mm_movemask_epi8(_mm_and_si128(head_match, tail_match));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp_query(&text[i + bit], query) == 0)
+        return &text[i + bit];
+      mask &= mask - 1;
+    }
+  }
+#endif
+
+  for (; i < end; i++) {
+    unsigned char c = text[i];
+    unsigned char d = text[i + n - 1];
+    if ((c == first || c == first_other) && (d == last || d == last_other) &&
+        memcmp_query(&text[i], query) == 0)
+      return &text[i];
+  }
+  return NULL;
+}
+
+// the text of a row for searching, mapped rows are used in place
+const char *search_row_text(editor_row *row) {
+  return row->mapped ? row->chars : row_text(row);
+}
+
+// first match at or after from in text, a pattern sees the whole text so
+// that ^ and $ keep referring to the row
+const char *search_text(struct search_query *query, const char *text,
+                        size_t length, size_t from) {
+  if (query->regex) {
+    int captures[EDI_REGEX_GROUPS * 2];
+    return regex_search(query->regex, text, length, from, captures)
+               ? &text[captures[0]]
+               : NULL;
+  }
+  return search_memory(&text[from], length - from, query);
+}
+
+// next match at or after column from_x of row y, searching at most rows
+// rows, runs of mapped rows that are adjacent in the file are scanned as
+// one buffer since the newlines between them can never be part of a literal
+// match, and so are whole paged out blocks
+bool search_forward(struct search_query *query, int y, int from_x, int rows,
+                    int *match_y, int *match_x) {
+  row_iterator it = row_iterator_at(y);
+  editor_row *row;
+  row_block *page;
+  // spans start small so that dense matches do not pay for a long batch
+  long span_limit = 256;
+  while (rows > 0) {
+    const char *start, *end;
+    int from = 0, span_rows;
+    if (!query->regex && from_x == 0 && (page = row_iterator_page(&it)) &&
+        page->size <= rows) {
+      start = page->page_start;
+      end = page->page_end;
+      span_rows = page->size;
+      it.index = page->size;
+    } else if ((row = row_iterator_next(&it))) {
+      start = search_row_text(row);
+      end = start + row->size;
+      from = from_x < row->size ? from_x : row->size;
+      span_rows = 1;
+      // peeking may page out the block of row, only start and end are kept
+      if (row->mapped && !query->regex) {
+        row_iterator peek = it;
+        editor_row *next;
+        while (span_rows < rows && end - start < span_limit &&
+               row_iterator_page(&peek) == NULL &&
+               (next = row_iterator_next(&peek)) && next->mapped &&
+               next->chars == end + 1 && *end == '\n') {
+          end = next->chars + next->size;
+          it = peek;
+          span_rows++;
+        }
+      }
+    } else {
+      break;
+    }
+
+    const char *line = start;
+    const char *match = search_text(query, line, end - line, from);
+    if (match) {
+      // newlines before the match tell the row, the column is measured
+      // from the start of that row
+      const char *newline;
+      int line_y = y;
+      while ((newline = memchr(line, '\n', match - line)) != NULL) {
+        line = newline + 1;
+        line_y++;
+      }
+      *match_y = line_y;
+      *match_x = match - line;
+      return true;
+    }
+
+    y += span_rows;
+    rows -= span_rows;
+    from_x = 0;
+    if (span_limit < EDI_SEARCH_SPAN)
+      span_limit *= 2;
+  }
+  return false;
+}
+
+// last match starting before column before_x of row y, a negative before_x
+// takes the whole row, searching at most rows rows backwards
+bool search_backward(struct search_query *query, int y, int before_x,
+                     int rows, int *match_y, int *match_x) {
+  row_iterator it = row_iterator_at(y + 1);
+  editor_row *row;
+  for (; rows > 0 && (row = row_iterator_previous(&it)); y--, rows--) {
+    const char *text = search_row_text(row);
+    size_t length = row->size;
+    const char *match, *found = NULL;
+    size_t from = 0;
+    while (from <= length && (match = search_text(query, text, length, from)) &&
+           (before_x < 0 || match - text < before_x)) {
+      found = match;
+      from = match - text + 1;
+    }
+    before_x = -1;
+    if (found) {
+      *match_y = y;
+      *match_x = found - text;
+      return true;
+    }
+  }
+  return false;
+}
+
+// searches from the cursor in the given direction and wraps around the end
+// of the document once
+bool find_from_cursor(struct search_query *query, int direction) {
+  int rows = EDITOR.number_of_rows;
+  int y = EDITOR.cursor_y, x = EDITOR.cursor_x;
+  int match_y, match_x;
+  bool found;
+
+  if (direction > 0) {
+    found = search_forward(query, y, x + 1, rows - y, &match_y, &match_x);
+    // rows that are still loading are searched as they arrive
+    while (!found && LOADER.running) {
+      load_wait_rows(rows + 1);
+      found = search_forward(query, rows, 0, EDITOR.number_of_rows - rows,
+                             &match_y, &match_x);
+      rows = EDITOR.number_of_rows;
+    }
+    found = found || search_forward(query, 0, 0, y + 1, &match_y, &match_x);
+  } else {
+    found = y < rows && search_backward(query, y, x, y + 1, &match_y, &match_x);
+    if (!found) {
+      load_finish(); // wrapping starts at the last row of the file
+      rows = EDITOR.number_of_rows;
+      found = search_backward(query, rows - 1, -1, rows, &match_y, &match_x);
+    }
+  }
+
+  if (found) {
+    EDITOR.cursor_y = match_y;
+    EDITOR.cursor_x = match_x;
+    EDITOR.row_offset = EDITOR.number_of_rows; // scroll the match to the top
+  }
+  return found;
+}
+
+// search as you type runs forward from the origin and wraps around once,
+// scanning a bounded number of rows per frame, a literal query that grows
+// resumes where the shorter one stopped as its matches are a subset of the
+// shorter one's
+struct find_state {
+  int saved_cursor_x, saved_cursor_y;
+  int saved_row_offset, saved_col_offset;
+  bool ignore_case;
+  bool regex;
+
+  // the last pattern compiled, kept while the prompt text stays the same
+  char *pattern;
+  bool pattern_ignore_case;
+  struct regex *compiled;
+  const char *pattern_error;
+
+  char *query; // query the scan below belongs to
+  int origin_y, origin_x;
+  int next_y, next_x; // where the scan continues
+  bool wrapped;
+  bool scanning;
+  bool found;
+} FIND;
+
+// the query for text in the current modes, false while text is not a valid
+// pattern
+bool find_query(const char *text, struct search_query *query) {
+  query->needle = text;
+  query->length = strlen(text);
+  query->ignore_case = FIND.ignore_case;
+  query->regex = NULL;
+  if (!FIND.regex)
+    return true;
+
+  if (FIND.pattern == NULL || strcmp(FIND.pattern, text) != 0 ||
+      FIND.pattern_ignore_case != FIND.ignore_case) {
+    free(FIND.pattern);
+    regex_free(FIND.compiled);
+    FIND.pattern = strdup(text);
+    FIND.pattern_ignore_case = FIND.ignore_case;
+    FIND.compiled = regex_compile(text, FIND.ignore_case, &FIND.pattern_error);
+  }
+  query->regex = FIND.compiled;
+  return FIND.compiled != NULL;
+}
+
+// continues the search as you type for at most EDI_INCREMENTAL_ROWS rows,
+// starting at the cursor so the visible rows below it come first
+void incremental_search_step() {
+  struct search_query query;
+  bool valid = find_query(FIND.query, &query);
+  if (!valid)
+    FIND.scanning = false;
+  int budget = EDI_INCREMENTAL_ROWS;
+  while (FIND.scanning && budget > 0) {
+    int end = FIND.wrapped ? FIND.origin_y + 1 : EDITOR.number_of_rows;
+    int rows = end - FIND.next_y < budget ? end - FIND.next_y : budget;
+    int match_y, match_x;
+    if (rows > 0 && search_forward(&query, FIND.next_y, FIND.next_x, rows,
+                                   &match_y, &match_x)) {
+      FIND.scanning = false;
+      FIND.found = true;
+      EDITOR.cursor_y = match_y;
+      EDITOR.cursor_x = match_x;
+      EDITOR.prompt_note[0] = '\0';
+      return;
+    }
+
+    FIND.next_y += rows;
+    FIND.next_x = 0;
+    budget -= rows;
+    if (FIND.next_y >= end && !FIND.wrapped && LOADER.running)
+      return; // goes on when the loader delivers more rows
+    if (FIND.next_y >= end) {
+      FIND.scanning = !FIND.wrapped;
+      FIND.wrapped = true;
+      FIND.next_y = 0;
+    }
+  }
+  // the prompt tells why the cursor went back to where the search started
+  if (!valid)
+    snprintf(EDITOR.prompt_note, sizeof(EDITOR.prompt_note),
+             "bad pattern: %s", FIND.pattern_error);
+  else if (!FIND.scanning && !FIND.found && query.length > 0)
+    snprintf(EDITOR.prompt_note, sizeof(EDITOR.prompt_note), "not found");
+}
+
+// false while the scan is done or waits for rows that are still loading
+bool incremental_search_runnable() {
+  return FIND.scanning &&
+         (FIND.wrapped || FIND.next_y < EDITOR.number_of_rows ||
+          !LOADER.running);
+}
+
+void incremental_search(char *query_text) {
+  if (FIND.query && strcmp(query_text, FIND.query) == 0)
+    return;
+  size_t length = strlen(query_text);
+  size_t previous = FIND.query ? strlen(FIND.query) : 0;
+  bool grown = !FIND.regex && previous > 0 && length > previous &&
+               strncmp(query_text, FIND.query, previous) == 0;
+  free(FIND.query);
+  FIND.query = strdup(query_text);
+
+  if (!grown || length == 0) {
+    EDITOR.cursor_y = FIND.origin_y;
+    EDITOR.cursor_x = FIND.origin_x;
+    FIND.next_y = FIND.origin_y;
+    FIND.next_x = FIND.origin_x;
+    FIND.wrapped = false;
+    FIND.scanning = length > 0;
+    FIND.found = false;
+    EDITOR.prompt_note[0] = '\0';
+  } else if (FIND.found) {
+    // the longer query cannot match before the last match
+    FIND.next_y = EDITOR.cursor_y;
+    FIND.next_x = EDITOR.cursor_x;
+    FIND.scanning = true;
+    FIND.found = false;
+  } // a scan that is still running goes on, a finished one found nothing
+  incremental_search_step();
+}
+
+void find_callback(char *query_text, int key) {
+  struct search_query query;
+  bool valid = find_query(query_text, &query);
+  int direction = 0;
+
+  switch (key) {
+  case '\x1b':
+    FIND.scanning = false;
+    EDITOR.cursor_x = FIND.saved_cursor_x;
+    EDITOR.cursor_y = FIND.saved_cursor_y;
+    EDITOR.row_offset = FIND.saved_row_offset;
+    EDITOR.col_offset = FIND.saved_col_offset;
+    return;
+  case ENTER_KEY:
+    while (FIND.scanning)
+      incremental_search_step();
+    if (!valid)
+      set_status_message("Bad pattern: %s", FIND.pattern_error);
+    else if (!FIND.found)
+      set_status_message("'%s' not found", query_text);
+    return;
+  case '\t':
+  case CTRL_KEY('e'):
+    if (key == '\t')
+      FIND.ignore_case = !FIND.ignore_case;
+    else
+      FIND.regex = !FIND.regex;
+    free(FIND.query);
+    FIND.query = NULL; // the last scan used the other mode
+    incremental_search(query_text);
+    return;
+  case ARROW_RIGHT:
+  case ARROW_DOWN:
+    direction = 1;
+    break;
+  case ARROW_LEFT:
+  case ARROW_UP:
+    direction = -1;
+    break;
+  default:
+    incremental_search(query_text);
+    return;
+  }
+
+  if (query.length == 0 || !valid)
+    return;
+  FIND.scanning = false;
+  FIND.found = find_from_cursor(&query, direction);
+  FIND.origin_y = EDITOR.cursor_y; // typing on continues from this match
+  FIND.origin_x = EDITOR.cursor_x;
+  // a status message would be replaced by the prompt before it is drawn
+  if (FIND.found)
+    EDITOR.prompt_note[0] = '\0';
+  else
+    snprintf(EDITOR.prompt_note, sizeof(EDITOR.prompt_note), "not found");
+}
+
+void editor_find() {
+  FIND.saved_cursor_x = EDITOR.cursor_x;
+  FIND.saved_cursor_y = EDITOR.cursor_y;
+  FIND.saved_row_offset = EDITOR.row_offset;
+  FIND.saved_col_offset = EDITOR.col_offset;
+  FIND.origin_y = EDITOR.cursor_y;
+  FIND.origin_x = EDITOR.cursor_x;
+  FIND.found = false;
+
+  char *query = editor_prompt(
+      "Search: %s (Arrows: next/prev, Tab: case, Ctrl-E: regex)",
+      find_callback, false);
+  free(query);
+  free(FIND.query);
+  free(FIND.pattern);
+  regex_free(FIND.compiled);
+  FIND.query = NULL;
+  FIND.pattern = NULL;
+  FIND.compiled = NULL;
+}
+
+/* find all */
+
+struct search_match {
+  int y, x;
+};
+
+// a run of whole blocks scanned by one worker, each chunk collects its
+// matches in order so joining the chunks in order sorts the whole index
+struct find_all_chunk {
+  row_block *block;
+  int blocks;
+  int y; // row of the first block
+  editor_row *rows[EDI_FIND_CHUNK_BLOCKS]; // per block, NULL while paged out
+  struct search_match *matches;
+  int count, capacity;
+};
+
+// the workers only read the tree and the row chars, so edits stop the scan
+// and drop the index while a gap move on the main thread waits for the end
+struct find_all_state {
+  pthread_t threads[EDI_FIND_THREADS];
+  int thread_count;
+  struct find_all_chunk *chunks;
+  int chunk_count;
+  atomic_int next_chunk;
+  atomic_int chunks_done;
+  atomic_long found; // matches in the finished chunks
+  atomic_bool cancel;
+  int wake_fd; // eventfd bumped after every chunk, -1 without an event loop
+  bool running;
+
+  char *needle;
+  struct search_query query;
+  struct search_match *matches; // sorted once the scan is done
+  int count;
+  int current; // match the cursor was last moved to, -1 for none
+} FIND_ALL = {.wake_fd = -1, .current = -1};
+
+void find_all_add(struct find_all_chunk *chunk, int y, int x) {
+  if (chunk->count == chunk->capacity) {
+    chunk->capacity = chunk->capacity ? chunk->capacity * 2 : 64;
+    chunk->matches =
+        realloc(chunk->matches, chunk->capacity * sizeof(*chunk->matches));
+    if (chunk->matches == NULL)
+      die("realloc");
+  }
+  chunk->matches[chunk->count].y = y;
+  chunk->matches[chunk->count].x = x;
+  chunk->count++;
+}
+
+// every match in text, which holds row y and the rows after it joined by
+// newlines
+void find_all_scan_text(struct find_all_chunk *chunk, const char *text,
+                        size_t length, int y) {
+  const char *line = text, *p = text, *end = text + length;
+  const char *match, *newline;
+  while ((match = search_memory(p, end - p, &FIND_ALL.query))) {
+    while ((newline = memchr(line, '\n', match - line)) != NULL) {
+      line = newline + 1;
+      y++;
+    }
+    find_all_add(chunk, y, match - line);
+    p = match + 1;
+  }
+}
+
+void find_all_scan_chunk(struct find_all_chunk *chunk) {
+  row_block *block = chunk->block;
+  int y = chunk->y;
+  char *copy = NULL;
+  int copy_size = 0;
+
+  for (int b = 0; b < chunk->blocks && !atomic_load(&FIND_ALL.cancel); b++) {
+    if (chunk->rows[b] == NULL) {
+      // a paged out block is a run of lines in the file
+      find_all_scan_text(chunk, block->page_start,
+                         block->page_end - block->page_start, y);
+      y += block->size;
+      block = row_block_next(block);
+      continue;
+    }
+    for (int i = 0; i < block->size;) {
+      editor_row *row = &chunk->rows[b][i];
+      const char *start = row->chars, *end = start + row->size;
+      int span_rows = 1;
+      if (row->mapped) {
+        editor_row *next;
+        while (i + span_rows < block->size && end - start < EDI_SEARCH_SPAN &&
+               (next = &chunk->rows[b][i + span_rows])->mapped &&
+               next->chars == end + 1 && *end == '\n') {
+          end = next->chars + next->size;
+          span_rows++;
+        }
+      } else if (row->gap < row->size) {
+        // only the main thread moves gaps, the row is joined into a copy
+        if (copy_size < row->size) {
+          copy_size = row->size;
+          copy = realloc(copy, copy_size);
+          if (copy == NULL)
+            die("realloc");
+        }
+        memcpy(copy, row->chars, row->gap);
+        memcpy(&copy[row->gap],
+               &row->chars[row->gap + row->capacity - row->size],
+               row->size - row->gap);
+        start = copy;
+        end = copy + row->size;
+      }
+      find_all_scan_text(chunk, start, end - start, y + i);
+      i += span_rows;
+    }
+    y += block->size;
+    block = row_block_next(block);
+  }
+  free(copy);
+}
+
+void *find_all_worker(void *unused) {
+  (void)unused;
+  int i;
+  while (!atomic_load(&FIND_ALL.cancel) &&
+         (i = atomic_fetch_add(&FIND_ALL.next_chunk, 1)) <
+             FIND_ALL.chunk_count) {
+    find_all_scan_chunk(&FIND_ALL.chunks[i]);
+    atomic_fetch_add(&FIND_ALL.found, FIND_ALL.chunks[i].count);
+    atomic_fetch_add(&FIND_ALL.chunks_done, 1);
+    if (FIND_ALL.wake_fd != -1) {
+      uint64_t one = 1;
+      write(FIND_ALL.wake_fd, &one, sizeof(one));
+    }
+  }
+  return NULL;
+}
 
-  for (int j = 0; j < EDITOR.number_of_rows; j++)
-    total_length += EDITOR.row[j].size + 1;
+void find_all_join() {
+  for (int i = 0; i < FIND_ALL.thread_count; i++)
+    pthread_join(FIND_ALL.threads[i], NULL);
+  FIND_ALL.thread_count = 0;
+  FIND_ALL.running = false;
+  EDITOR.pages_pinned = false;
+}
 
-  *buffer_length = total_length;
+void free_find_all_chunks() {
+  for (int i = 0; i < FIND_ALL.chunk_count; i++)
+    free(FIND_ALL.chunks[i].matches);
+  free(FIND_ALL.chunks);
+  FIND_ALL.chunks = NULL;
+  FIND_ALL.chunk_count = 0;
+}
 
-  char *buffer = malloc(total_length);
-  char *p = buffer;
-  for (int j = 0; j < EDITOR.number_of_rows; j++) {
-    memcpy(p, EDITOR.row[j].chars, EDITOR.row[j].size);
-    p += EDITOR.row[j].size;
-    *p = '\n';
-    p++;
+// stops a running scan and forgets the results, an edit makes them stale
+void find_all_discard() {
+  if (FIND_ALL.running) {
+    atomic_store(&FIND_ALL.cancel, true);
+    find_all_join();
   }
-
-  return buffer;
+  free_find_all_chunks();
+  free(FIND_ALL.matches);
+  free(FIND_ALL.needle);
+  FIND_ALL.matches = NULL;
+  FIND_ALL.needle = NULL;
+  FIND_ALL.count = 0;
+  FIND_ALL.current = -1;
 }
 
-void open_file(char *filename) {
-  free(EDITOR.filename);
-  EDITOR.filename = strdup(filename);
-
-  FILE *file = fopen(filename, "r");
-  if (!file)
-    die("open_file");
+// waits for the workers and joins the chunk results into the index
+void find_all_wait() {
+  if (!FIND_ALL.running)
+    return;
+  find_all_join();
+
+  int count = 0;
+  for (int i = 0; i < FIND_ALL.chunk_count; i++)
+    count += FIND_ALL.chunks[i].count;
+  FIND_ALL.matches = malloc((count ? count : 1) * sizeof(*FIND_ALL.matches));
+  if (FIND_ALL.matches == NULL)
+    die("malloc");
+  for (int i = 0, at = 0; i < FIND_ALL.chunk_count; i++) {
+    memcpy(&FIND_ALL.matches[at], FIND_ALL.chunks[i].matches,
+           FIND_ALL.chunks[i].count * sizeof(*FIND_ALL.matches));
+    at += FIND_ALL.chunks[i].count;
+  }
+  FIND_ALL.count = count;
+  FIND_ALL.current = -1;
+  free_find_all_chunks();
+}
 
-  char *line = NULL;
-  size_t line_cap = 0;
-  ssize_t line_length;
+void find_all_start(const char *needle, bool ignore_case) {
+  find_all_discard();
+  load_finish(); // the chunks are cut from the whole tree
+  if (EDITOR.rows == NULL || needle[0] == '\0')
+    return;
 
-  while ((line_length = getline(&line, &line_cap, file)) != -1) {
-    while (line_length > 0 && (line[line_length - 1] == ENTER_KEY ||
-                               line[line_length - 1] == '\n'))
-      line_length--;
-    insert_editor_row_at(EDITOR.number_of_rows, line, line_length);
+  FIND_ALL.needle = strdup(needle);
+  FIND_ALL.query.needle = FIND_ALL.needle;
+  FIND_ALL.query.length = strlen(needle);
+  FIND_ALL.query.ignore_case = ignore_case;
+
+  // the workers number lines by block sizes, which must all be verified
+  for (row_block *block = row_iterator_at(0).block; block;
+       block = row_block_next(block))
+    page_check(block);
+  int blocks = block_count(EDITOR.rows);
+  FIND_ALL.chunk_count =
+      (blocks + EDI_FIND_CHUNK_BLOCKS - 1) / EDI_FIND_CHUNK_BLOCKS;
+  FIND_ALL.chunks = calloc(FIND_ALL.chunk_count, sizeof(*FIND_ALL.chunks));
+  if (FIND_ALL.chunks == NULL)
+    die("calloc");
+  row_block *block = row_iterator_at(0).block;
+  int y = 0;
+  for (int i = 0; i < FIND_ALL.chunk_count; i++) {
+    struct find_all_chunk *chunk = &FIND_ALL.chunks[i];
+    chunk->block = block;
+    chunk->y = y;
+    for (; block && chunk->blocks < EDI_FIND_CHUNK_BLOCKS; chunk->blocks++) {
+      chunk->rows[chunk->blocks] = block->rows;
+      y += block->size;
+      block = row_block_next(block);
+    }
   }
 
-  free(line);
-  fclose(file);
+  atomic_store(&FIND_ALL.next_chunk, 0);
+  atomic_store(&FIND_ALL.chunks_done, 0);
+  atomic_store(&FIND_ALL.found, 0);
+  atomic_store(&FIND_ALL.cancel, false);
+
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > EDI_FIND_THREADS)
+    threads = EDI_FIND_THREADS;
+  if (threads > FIND_ALL.chunk_count)
+    threads = FIND_ALL.chunk_count;
+  if (threads < 1)
+    threads = 1;
+  // the workers read the rows of resident blocks, which stay until the end
+  EDITOR.pages_pinned = true;
+  FIND_ALL.running = true;
+  for (; FIND_ALL.thread_count < threads; FIND_ALL.thread_count++) {
+    if (pthread_create(&FIND_ALL.threads[FIND_ALL.thread_count], NULL,
+                       find_all_worker, NULL) != 0)
+      die("pthread_create");
+  }
+}
 
-  EDITOR.file_modified = false;
+// called from the event loop whenever a worker finished a chunk
+void find_all_progress() {
+  if (FIND_ALL.running &&
+      atomic_load(&FIND_ALL.chunks_done) == FIND_ALL.chunk_count) {
+    find_all_wait();
+    set_status_message("%d matches for '%s'", FIND_ALL.count, FIND_ALL.needle);
+  }
 }
 
-void save_file() {
-  if (EDITOR.filename == NULL) {
-    EDITOR.filename = editor_prompt("Save as: %s");
-    if (EDITOR.filename == NULL) {
-      set_status_message("Saving aborted...");
-      return;
-    }
+// first match at or after column x of row y
+int find_all_lower_bound(int y, int x) {
+  int low = 0, high = FIND_ALL.count;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    struct search_match *match = &FIND_ALL.matches[middle];
+    if (match->y < y || (match->y == y && match->x < x))
+      low = middle + 1;
+    else
+      high = middle;
   }
+  return low;
+}
 
-  int length;
-  char *write_buffer = editor_row_to_string(&length);
+// moves to the next or previous match, a step from the match the cursor
+// is on is a single index move, elsewhere the cursor is found by bisection
+void find_all_jump(int direction) {
+  if (FIND_ALL.needle == NULL) {
+    set_status_message("Nothing searched yet, Ctrl-G finds all matches");
+    return;
+  }
+  if (FIND_ALL.running) {
+    set_status_message("Still searching, %ld matches so far",
+                       atomic_load(&FIND_ALL.found));
+    return;
+  }
+  if (FIND_ALL.count == 0) {
+    set_status_message("'%s' not found", FIND_ALL.needle);
+    return;
+  }
 
-  int fd = open(EDITOR.filename, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, length) != -1) {
-      if (write(fd, write_buffer, length) == length) {
-        close(fd);
-        free(write_buffer);
-        EDITOR.file_modified = false;
-        set_status_message("%d bytes written to disk", length);
-        return;
-      }
-    }
-    close(fd);
+  int current = FIND_ALL.current;
+  struct search_match *match =
+      current >= 0 ? &FIND_ALL.matches[current] : NULL;
+  if (match && match->y == EDITOR.cursor_y && match->x == EDITOR.cursor_x) {
+    current += direction;
+  } else {
+    current = find_all_lower_bound(EDITOR.cursor_y, EDITOR.cursor_x);
+    if (direction < 0)
+      current--;
+    else if (current < FIND_ALL.count &&
+             FIND_ALL.matches[current].y == EDITOR.cursor_y &&
+             FIND_ALL.matches[current].x == EDITOR.cursor_x)
+      current++;
   }
+  current = (current + FIND_ALL.count) % FIND_ALL.count;
 
-  free(write_buffer);
-  set_status_message("Error while saving: %s", strerror(errno));
+  FIND_ALL.current = current;
+  EDITOR.cursor_y = FIND_ALL.matches[current].y;
+  EDITOR.cursor_x = FIND_ALL.matches[current].x;
+  EDITOR.row_offset = EDITOR.number_of_rows; // scroll the match to the top
 }
 
-/* find */
-
-void editor_find() {
-  char *query = editor_prompt("Search: %s");
+void editor_find_all() {
+  char *query = editor_prompt("Find all: %s (ESC to cancel)", NULL, false);
   if (query == NULL)
     return;
+  find_all_start(query, FIND.ignore_case);
+  free(query);
+}
 
-  bool found = false;
-
-  for (int i = 0; i < EDITOR.number_of_rows; i++) {
-    editor_row *row = &EDITOR.row[i];
-    char *match = strstr(row->render, query);
+// the find all part of the status bar, empty when there are no results
+int format_find_all_status(char *buffer, size_t length) {
+  if (FIND_ALL.needle == NULL)
+    return snprintf(buffer, length, "%s", "");
+  if (FIND_ALL.running)
+    return snprintf(buffer, length, "%ld matches... | ",
+                    atomic_load(&FIND_ALL.found));
+  if (FIND_ALL.current >= 0)
+    return snprintf(buffer, length, "match %d/%d | ", FIND_ALL.current + 1,
+                    FIND_ALL.count);
+  return snprintf(buffer, length, "%d matches | ", FIND_ALL.count);
+}
 
-    if (match) {
-      EDITOR.cursor_y = i;
-      EDITOR.cursor_x = match - row->render;
-      EDITOR.row_offset = EDITOR.number_of_rows;
-      break;
-    }
+// compares the search kernel with the strstr loop over render rows that
+// editor_find used before, counting every match in the file
+void benchmark_search(char *filename, char *needle) {
+  EDITOR.frame = 1; // nothing is on screen, every block may be trimmed
+  open_file(filename);
+  struct search_query query = {needle, strlen(needle), false, NULL};
+  struct timespec start, end;
+  size_t bytes = EDITOR.file_map_size;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long strstr_matches = 0;
+  editor_row *row;
+  row_iterator it = row_iterator_at(0);
+  while ((row = row_iterator_next(&it))) {
+    render_row(it.block, row);
+    if (row->columns)
+      update_render_row(row); // the old loop saw long rows whole
+    for (char *p = row->render; (p = strstr(p, needle)) != NULL; p++)
+      strstr_matches++;
   }
-
-  if (!found)
-    set_status_message("\'%s\' not found.");
-
-  free(query);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double strstr_seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long kernel_matches = 0;
+  int y = 0, x = 0, match_y, match_x;
+  while (search_forward(&query, y, x, EDITOR.number_of_rows - y, &match_y,
+                        &match_x)) {
+    kernel_matches++;
+    y = match_y;
+    x = match_x + 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double kernel_seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  find_all_start(needle, false);
+  int threads = FIND_ALL.thread_count;
+  find_all_wait();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double find_all_seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  // the same query as a pattern, through the DFA and the VM
+  const char *error;
+  query.regex = regex_compile(needle, false, &error);
+  long regex_matches = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  y = 0;
+  x = 0;
+  while (query.regex && search_forward(&query, y, x, EDITOR.number_of_rows - y,
+                                       &match_y, &match_x)) {
+    regex_matches++;
+    y = match_y;
+    x = match_x + 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double regex_seconds =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  regex_free(query.regex);
+
+  printf("strstr: %ld matches in %.3fs (%.0f MB/s)\n", strstr_matches,
+         strstr_seconds, bytes / strstr_seconds / 1e6);
+  printf("kernel: %ld matches in %.3fs (%.0f MB/s)\n", kernel_matches,
+         kernel_seconds, bytes / kernel_seconds / 1e6);
+  printf("find all: %d matches in %.3fs (%.0f MB/s, %d threads)\n",
+         FIND_ALL.count, find_all_seconds, bytes / find_all_seconds / 1e6,
+         threads);
+  printf("regex: %ld matches in %.3fs (%.0f MB/s)\n", regex_matches,
+         regex_seconds, bytes / regex_seconds / 1e6);
 }
+
 /*  append buffer */
 
 struct append_buffer {
@@ -437,6 +4773,8 @@ struct append_buffer {
 
 void append_buffer_append(struct append_buffer *ab, const char *append_s,
                           int append_len) {
+  if (append_len == 0)
+    return; // realloc to zero bytes would free the buffer
   char *new = realloc(ab->b, ab->len + append_len);
 
   if (new == NULL)
@@ -448,14 +4786,227 @@ void append_buffer_append(struct append_buffer *ab, const char *append_s,
 
 void append_buffer_free(struct append_buffer *ab) { free(ab->b); }
 
+/* replace */
+
+// appends the replacement template with \0 to \9 standing for the groups
+// of the match and \\ for a backslash
+void expand_replacement(struct append_buffer *ab, const char *replacement,
+                        const char *text, int *captures, int groups) {
+  for (const char *p = replacement; *p; p++) {
+    if (p[0] == '\\' && isdigit((unsigned char)p[1])) {
+      int group = *++p - '0';
+      if (group < groups && captures[group * 2] != -1)
+        append_buffer_append(ab, &text[captures[group * 2]],
+                             captures[group * 2 + 1] - captures[group * 2]);
+    } else if (p[0] == '\\' && p[1] == '\\') {
+      append_buffer_append(ab, p++, 1);
+    } else {
+      append_buffer_append(ab, p, 1);
+    }
+  }
+}
+
+// rewrites every row holding a match in a single pass over its text,
+// returns the number of replacements
+int replace_all(struct regex *re, const char *replacement, int *rows_changed) {
+  find_all_discard();
+  load_finish();
+  int replacements = 0;
+  *rows_changed = 0;
+
+  struct append_buffer ab = ABUF_INIT;
+  int captures[EDI_REGEX_GROUPS * 2];
+  row_iterator it = row_iterator_at(0);
+  editor_row *row;
+  for (int y = 0; (row = row_iterator_next(&it)); y++) {
+    const char *text = search_row_text(row);
+    int at = 0;
+    ab.len = 0;
+    while (at <= row->size &&
+           regex_search(re, text, row->size, at, captures)) {
+      append_buffer_append(&ab, &text[at], captures[0] - at);
+      expand_replacement(&ab, replacement, text, captures, re->groups);
+      replacements++;
+      at = captures[1];
+      if (captures[1] == captures[0]) {
+        // an empty match keeps the next character and moves past it
+        if (at < row->size)
+          append_buffer_append(&ab, &text[at], 1);
+        at++;
+      }
+    }
+    if (at == 0)
+      continue;
+    if (at < row->size)
+      append_buffer_append(&ab, &text[at], row->size - at);
+    set_row_text(row, ab.b, ab.len);
+    highlight_edited(y);
+    (*rows_changed)++;
+  }
+  append_buffer_free(&ab);
+
+  if (EDITOR.cursor_y < EDITOR.number_of_rows &&
+      EDITOR.cursor_x > row_at(EDITOR.cursor_y)->size)
+    EDITOR.cursor_x = row_at(EDITOR.cursor_y)->size;
+  return replacements;
+}
+
+void editor_replace_all() {
+  char *pattern =
+      editor_prompt("Replace pattern: %s (ESC to cancel)", NULL, false);
+  if (pattern == NULL)
+    return;
+  const char *error;
+  struct regex *re = regex_compile(pattern, FIND.ignore_case, &error);
+  if (re == NULL) {
+    set_status_message("Bad pattern: %s", error);
+    free(pattern);
+    return;
+  }
+
+  char *replacement =
+      editor_prompt("Replace with: %s (\\1 to \\9 insert groups)", NULL, true);
+  if (replacement) {
+    int rows;
+    int replacements = replace_all(re, replacement, &rows);
+    set_status_message("%d replacements in %d rows", replacements, rows);
+  }
+  free(replacement);
+  regex_free(re);
+  free(pattern);
+}
+
+/* events */
+
+void init_events() {
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+    die("sigprocmask");
+
+  EDITOR.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (EDITOR.signal_fd == -1)
+    die("signalfd");
+  EDITOR.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (EDITOR.timer_fd == -1)
+    die("timerfd_create");
+  FIND_ALL.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (FIND_ALL.wake_fd == -1)
+    die("eventfd");
+  LOADER.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (LOADER.wake_fd == -1)
+    die("eventfd");
+}
+
+void handle_resize() {
+  struct signalfd_siginfo info;
+  while (read(EDITOR.signal_fd, &info, sizeof(info)) == sizeof(info))
+    ;
+
+  update_window_size();
+  invalidate_frame();
+  refresh_screen();
+}
+
+// arms the timer for the closest pending deadline, 0 when there is none
+time_t arm_timer() {
+  time_t now = time(NULL);
+  time_t deadline = 0;
+  time_t message_deadline = EDITOR.status_message_time + EDI_MESSAGE_SECONDS;
+  if (EDITOR.status_message[0] != '\0' && message_deadline > now)
+    deadline = message_deadline;
+  if (EDITOR.autosave_deadline &&
+      (deadline == 0 || EDITOR.autosave_deadline < deadline))
+    deadline = EDITOR.autosave_deadline;
+
+  struct itimerspec timer = {{0, 0}, {0, 0}};
+  if (deadline)
+    timer.it_value.tv_sec = deadline > now ? deadline - now : 0;
+  if (deadline && deadline <= now)
+    timer.it_value.tv_nsec = 1; // already due, zero would disarm the timer
+  timerfd_settime(EDITOR.timer_fd, 0, &timer, NULL);
+  return deadline;
+}
+
+void handle_timer() {
+  uint64_t expirations;
+  read(EDITOR.timer_fd, &expirations, sizeof(expirations));
+
+  if (EDITOR.autosave_deadline && EDITOR.autosave_deadline <= time(NULL))
+    autosave();
+  refresh_screen(); // lets an expired message disappear
+}
+
+void handle_find_all_wake() {
+  uint64_t chunks;
+  read(FIND_ALL.wake_fd, &chunks, sizeof(chunks));
+  find_all_progress();
+  refresh_screen(); // the status bar shows the running match count
+}
+
+void handle_load_wake() {
+  uint64_t batches;
+  read(LOADER.wake_fd, &batches, sizeof(batches));
+  load_splice();
+  if (FIND.scanning)
+    incremental_search_step(); // may have been waiting for these rows
+  refresh_screen(); // the status bar shows the load progress
+}
+
+void handle_follow_wake() {
+  // the events only say that something happened, the file tells what
+  char events[4096];
+  while (read(FOLLOW.inotify_fd, events, sizeof(events)) > 0)
+    ;
+  follow_update();
+  refresh_screen();
+}
+
+// sleeps until stdin is readable, handling resizes, timers, find all, load
+// and follow progress meanwhile, returns false when timeout_ms passed first
+bool wait_for_input(int timeout_ms) {
+  struct pollfd fds[6] = {{STDIN_FILENO, POLLIN, 0},
+                          {EDITOR.signal_fd, POLLIN, 0},
+                          {EDITOR.timer_fd, POLLIN, 0},
+                          {FIND_ALL.wake_fd, POLLIN, 0},
+                          {LOADER.wake_fd, POLLIN, 0},
+                          {FOLLOW.inotify_fd, POLLIN, 0}};
+  while (true) {
+    arm_timer();
+    int ready = poll(fds, 6, timeout_ms);
+    if (ready == -1 && errno != EINTR)
+      die("poll");
+    if (ready == -1)
+      continue;
+    if (ready == 0)
+      return false;
+
+    if (fds[1].revents & POLLIN)
+      handle_resize();
+    if (fds[2].revents & POLLIN)
+      handle_timer();
+    if (fds[3].revents & POLLIN)
+      handle_find_all_wake();
+    if (fds[4].revents & POLLIN)
+      handle_load_wake();
+    if (fds[5].revents & POLLIN)
+      handle_follow_wake();
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+      return true;
+  }
+}
+
 /* input */
 
-char *editor_prompt(char *prompt) {
+char *editor_prompt(char *prompt, void (*callback)(char *, int),
+                    bool allow_empty) {
   size_t buffer_max_length = 128;
   char *buffer = malloc(buffer_max_length);
 
   size_t buffer_length = 0;
   buffer[0] = '\0';
+  EDITOR.prompt_note[0] = '\0';
 
   while (true) {
     set_status_message(prompt, buffer);
@@ -465,21 +5016,43 @@ char *editor_prompt(char *prompt) {
 
     if (c == '\x1b') {
       set_status_message("");
+      EDITOR.prompt_note[0] = '\0';
+      if (callback)
+        callback(buffer, c);
       free(buffer);
       return NULL;
 
     } else if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) {
-      if (buffer_length != 0) {
-        buffer_length--;
-        buffer[buffer_length] = '\0';
-      }
+      while (buffer_length != 0 &&
+             utf8_continuation(buffer[--buffer_length]))
+        ; // a whole UTF-8 char goes
+      buffer[buffer_length] = '\0';
     } else if (c == ENTER_KEY) {
-      if (buffer_length != 0) {
+      if (buffer_length != 0 || allow_empty) {
         set_status_message("");
+        EDITOR.prompt_note[0] = '\0';
+        if (callback)
+          callback(buffer, c);
         return buffer;
       }
 
-    } else if (!iscntrl(c) && c < 128) {
+    } else if (c == PASTE_KEY) {
+      // the prompt takes the printable part of the first pasted line
+      for (int i = 0; i < EDITOR.paste_length; i++) {
+        unsigned char ch = EDITOR.paste[i];
+        if (ch == '\r' || ch == '\n')
+          break;
+        if (iscntrl(ch))
+          continue;
+        if (buffer_length == buffer_max_length - 1) {
+          buffer_max_length *= 2;
+          buffer = realloc(buffer, buffer_max_length);
+        }
+        buffer[buffer_length++] = ch;
+      }
+      buffer[buffer_length] = '\0';
+      EDITOR.paste_ready = false;
+    } else if (!iscntrl(c) && c < 256) { // UTF-8 arrives a byte at a time
       if (buffer_length == buffer_max_length - 1) {
         buffer_max_length *= 2;
         buffer = realloc(buffer, buffer_max_length);
@@ -488,24 +5061,26 @@ char *editor_prompt(char *prompt) {
       buffer_length++;
       buffer[buffer_length] = '\0';
     }
+
+    if (callback)
+      callback(buffer, c);
   }
 }
 
 void move_cursor(int key_pressed) {
-  editor_row *row = (EDITOR.cursor_y >= EDITOR.number_of_rows)
-                        ? NULL
-                        : &EDITOR.row[EDITOR.cursor_y];
+  editor_row *row = row_at(EDITOR.cursor_y);
   switch (key_pressed) {
   case ARROW_LEFT:
     if (EDITOR.cursor_x > 0) {
-      EDITOR.cursor_x--;
+      EDITOR.cursor_x = char_start(row, EDITOR.cursor_x - 1);
     } else if (EDITOR.cursor_y > 0) {
       EDITOR.cursor_y--;
-      EDITOR.cursor_x = EDITOR.row[EDITOR.cursor_y].size;
+      EDITOR.cursor_x = row_at(EDITOR.cursor_y)->size;
     }
     break;
 
   case ARROW_DOWN:
+    load_wait_rows(EDITOR.cursor_y + 2); // the row below may still be loading
     if (EDITOR.cursor_y < EDITOR.number_of_rows)
       EDITOR.cursor_y++;
     break;
@@ -517,10 +5092,13 @@ void move_cursor(int key_pressed) {
 
   case ARROW_RIGHT:
     if (row && (EDITOR.cursor_x < (row->size))) {
-      EDITOR.cursor_x++;
-    } else if (EDITOR.cursor_y < EDITOR.number_of_rows) {
-      EDITOR.cursor_y++;
-      EDITOR.cursor_x = 0;
+      EDITOR.cursor_x = skip_cut_char(row, EDITOR.cursor_x + 1);
+    } else {
+      load_wait_rows(EDITOR.cursor_y + 2);
+      if (EDITOR.cursor_y < EDITOR.number_of_rows) {
+        EDITOR.cursor_y++;
+        EDITOR.cursor_x = 0;
+      }
     }
     break;
 
@@ -529,81 +5107,290 @@ void move_cursor(int key_pressed) {
   }
 
   // snap cursor end of line if moved to shorter line
-  row = (EDITOR.cursor_y >= EDITOR.number_of_rows)
-            ? NULL
-            : &EDITOR.row[EDITOR.cursor_y];
+  row = row_at(EDITOR.cursor_y);
   int row_length = row ? row->size : 0;
   if (EDITOR.cursor_x > row_length)
     EDITOR.cursor_x = row_length;
+  if (row && EDITOR.cursor_x < row_length)
+    EDITOR.cursor_x = char_start(row, EDITOR.cursor_x);
 }
 
-int read_keypress() {
-  int read_return;
-  char c;
-  while ((read_return = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (read_return == -1 && errno != EAGAIN)
+// reads everything stdin has ready into the input ring, returns the count
+int fill_input() {
+  int total = 0;
+  while (EDITOR.input_length < EDI_INPUT_BUFFER_SIZE) {
+    int end =
+        (EDITOR.input_start + EDITOR.input_length) % EDI_INPUT_BUFFER_SIZE;
+    int room = EDI_INPUT_BUFFER_SIZE - EDITOR.input_length;
+    if (end + room > EDI_INPUT_BUFFER_SIZE)
+      room = EDI_INPUT_BUFFER_SIZE - end;
+
+    int read_return = read(STDIN_FILENO, &EDITOR.input[end], room);
+    PERF.reads++;
+    if (read_return == -1 && errno != EAGAIN && errno != EINTR)
       die("read");
+    if (read_return <= 0)
+      break;
+    EDITOR.input_length += read_return;
+    total += read_return;
+    if (read_return < room)
+      break;
+  }
+  return total;
+}
+
+int input_peek(int offset) {
+  return EDITOR.input[(EDITOR.input_start + offset) % EDI_INPUT_BUFFER_SIZE];
+}
+
+void input_consume(int length) {
+  EDITOR.input_start = (EDITOR.input_start + length) % EDI_INPUT_BUFFER_SIZE;
+  EDITOR.input_length -= length;
+}
+
+// moves pasted bytes out of the input ring until the closing marker arrives
+int decode_paste() {
+  static const char end_marker[] = "\x1b[201~";
+  int marker_length = sizeof(end_marker) - 1;
+
+  int length = 0;
+  while (length < EDITOR.input_length) {
+    int matched = 0;
+    while (matched < marker_length && length + matched < EDITOR.input_length &&
+           input_peek(length + matched) == end_marker[matched])
+      matched++;
+    if (matched == marker_length || length + matched == EDITOR.input_length)
+      break; // the marker or a prefix of it at the end of the ring
+    length++;
+  }
+
+  if (EDITOR.paste_length + length > EDITOR.paste_capacity) {
+    EDITOR.paste_capacity = (EDITOR.paste_length + length) * 2;
+    EDITOR.paste = realloc(EDITOR.paste, EDITOR.paste_capacity);
   }
+  for (int i = 0; i < length; i++)
+    EDITOR.paste[EDITOR.paste_length++] = input_peek(i);
+  input_consume(length);
+
+  if (EDITOR.input_length < marker_length)
+    return -1;
+  input_consume(marker_length);
+  EDITOR.pasting = false;
+  EDITOR.paste_ready = true;
+  return PASTE_KEY;
+}
+
+// decodes one key from the front of the input ring, returns -1 while an
+// escape sequence is still incomplete unless flush is set
+int decode_key(bool flush) {
+  if (EDITOR.pasting)
+    return decode_paste();
 
-  // handle escape sequences
   char esc = '\x1b';
+  int c = input_peek(0);
+  if (c != esc || EDITOR.input_length == 1) {
+    if (c == esc && !flush)
+      return -1;
+    input_consume(1);
+    return c;
+  }
 
-  if (c == esc) {
-    char sequence[3];
-    if ((read_return = read(STDIN_FILENO, &sequence[0], 1)) != 1)
-      return esc;
-    if ((read_return = read(STDIN_FILENO, &sequence[1], 1)) != 1)
+  int sequence = input_peek(1);
+  if (sequence == 'O') {
+    if (EDITOR.input_length < 3) {
+      if (!flush)
+        return -1;
+      input_consume(EDITOR.input_length);
       return esc;
+    }
+    int final = input_peek(2);
+    input_consume(3);
+    switch (final) {
+    case 'H':
+      return HOME_KEY;
+    case 'F':
+      return END_KEY;
+    }
+    return esc;
+  }
+  if (sequence != '[') {
+    input_consume(2);
+    return esc;
+  }
 
-    if (sequence[0] == '[') {
-      if (sequence[1] >= '0' && sequence[1] <= '9') {
-        if ((read_return = read(STDIN_FILENO, &sequence[2], 1)) != 1)
-          return esc;
-        if (sequence[2] == '~') {
-          switch (sequence[1]) {
-          case '1':
-            return HOME_KEY;
-          case '3':
-            return DEL_KEY;
-          case '4':
-            return END_KEY;
-          case '5':
-            return PAGE_UP;
-          case '6':
-            return PAGE_DOWN;
-          }
-        }
-      } else {
-        switch (sequence[1]) {
-        case 'A':
-          return ARROW_UP;
-        case 'B':
-          return ARROW_DOWN;
-        case 'C':
-          return ARROW_RIGHT;
-        case 'D':
-          return ARROW_LEFT;
-        case 'H':
+  // control sequence: parameters followed by a final byte
+  int length = 2;
+  int parameter = 0;
+  while (length < EDITOR.input_length) {
+    int final = input_peek(length++);
+    if (final >= '0' && final <= '9') {
+      parameter = parameter * 10 + (final - '0');
+    } else if (final != ';') {
+      input_consume(length);
+      if (final == '~') {
+        switch (parameter) {
+        case 200:
+          EDITOR.pasting = true;
+          EDITOR.paste_length = 0;
+          return EDITOR.input_length > 0 ? decode_paste() : -1;
+        case 1:
+        case 7:
           return HOME_KEY;
-        case 'F':
+        case 3:
+          return DEL_KEY;
+        case 4:
+        case 8:
           return END_KEY;
-        default:
-          return esc;
+        case 5:
+          return PAGE_UP;
+        case 6:
+          return PAGE_DOWN;
         }
+        return esc;
       }
-    } else if (sequence[0] == '0') {
-      switch (sequence[1]) {
+      switch (final) {
+      case 'A':
+        return ARROW_UP;
+      case 'B':
+        return ARROW_DOWN;
+      case 'C':
+        return ARROW_RIGHT;
+      case 'D':
+        return ARROW_LEFT;
       case 'H':
         return HOME_KEY;
       case 'F':
         return END_KEY;
       }
+      return esc;
     }
+  }
 
-    return esc;
-  } else {
-    return c;
+  if (!flush && length < 16)
+    return -1;
+  input_consume(length);
+  return esc;
+}
+
+void decode_input(bool flush) {
+  while (EDITOR.input_length > 0 && EDITOR.key_count < EDI_KEY_QUEUE_SIZE &&
+         !EDITOR.paste_ready) {
+    int key = decode_key(flush);
+    if (key == -1)
+      break;
+    EDITOR.keys[(EDITOR.key_start + EDITOR.key_count++) % EDI_KEY_QUEUE_SIZE] =
+        key;
+  }
+}
+
+// true when a key can be processed without waiting for the terminal
+bool input_pending() {
+  if (EDITOR.key_count > 0)
+    return true;
+  struct pollfd stdin_poll = {STDIN_FILENO, POLLIN, 0};
+  if (poll(&stdin_poll, 1, 0) == 1) {
+    fill_input();
+    decode_input(false);
+  }
+  return EDITOR.key_count > 0;
+}
+
+long long elapsed_ns(struct timespec *from) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - from->tv_sec) * 1000000000LL +
+         (now.tv_nsec - from->tv_nsec);
+}
+
+int compare_long_longs(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// printed when the replay exits, at the end of the script or on Ctrl-Q
+void replay_report() {
+  double seconds = elapsed_ns(&REPLAY.start) / 1e9;
+  qsort(REPLAY.latencies, REPLAY.count, sizeof(long long), compare_long_longs);
+  fprintf(REPLAY.report, "open: %.3fs\n", REPLAY.open_seconds);
+  fprintf(REPLAY.report, "keys: %d in %.3fs\n", REPLAY.count, seconds);
+  if (REPLAY.count > 0) {
+    long long *latency = REPLAY.latencies;
+    int last = REPLAY.count - 1;
+    fprintf(REPLAY.report,
+            "latency us: p50 %.1f p90 %.1f p99 %.1f max %.1f\n",
+            latency[last * 50 / 100] / 1e3, latency[last * 90 / 100] / 1e3,
+            latency[last * 99 / 100] / 1e3, latency[last] / 1e3);
+  }
+  fprintf(REPLAY.report, "output: %lld bytes, %.0f per key\n",
+          EDITOR.total_bytes_written,
+          (double)EDITOR.total_bytes_written /
+              (REPLAY.count ? REPLAY.count : 1));
+  fprintf(REPLAY.report, "row allocations: %lld\n",
+          ALLOCATOR.allocations - REPLAY.start_allocations);
+  fclose(REPLAY.report);
+}
+
+// the next key of the script, the script ending ends the replay
+int replay_keypress() {
+  if (REPLAY.timing) {
+    if (REPLAY.count == REPLAY.capacity) {
+      REPLAY.capacity = REPLAY.capacity ? REPLAY.capacity * 2 : 1024;
+      REPLAY.latencies = realloc(REPLAY.latencies,
+                                 REPLAY.capacity * sizeof(long long));
+      if (REPLAY.latencies == NULL)
+        die("realloc");
+    }
+    REPLAY.latencies[REPLAY.count++] = elapsed_ns(&REPLAY.key_start);
+    REPLAY.timing = false;
+  }
+
+  wait_for_input(0); // finished loads and scans are picked up between keys
+  if (EDITOR.key_count == 0) {
+    fill_input();
+    decode_input(false);
+  }
+  if (EDITOR.key_count == 0 && EDITOR.input_length > 0)
+    decode_input(true); // the end of the script ends an escape sequence
+  if (EDITOR.key_count == 0)
+    exit(EXIT_SUCCESS);
+
+  int key = EDITOR.keys[EDITOR.key_start];
+  EDITOR.key_start = (EDITOR.key_start + 1) % EDI_KEY_QUEUE_SIZE;
+  EDITOR.key_count--;
+  REPLAY.timing = true;
+  PERF.keys++;
+  clock_gettime(CLOCK_MONOTONIC, &REPLAY.key_start);
+  return key;
+}
+
+int read_keypress() {
+  if (REPLAY.active)
+    return replay_keypress();
+  while (EDITOR.key_count == 0) {
+    // an escape byte that stays alone until the timeout is the escape key
+    bool incomplete = EDITOR.input_length > 0 && !EDITOR.pasting;
+    int timeout = incomplete ? EDI_ESCAPE_TIMEOUT_MS : -1;
+    if (!incomplete && incremental_search_runnable())
+      timeout = 0; // search as you type goes on while no key is waiting
+    if (!wait_for_input(timeout)) {
+      if (incomplete) {
+        decode_input(true);
+      } else {
+        incremental_search_step();
+        refresh_screen();
+      }
+      continue;
+    }
+    if (fill_input() == 0 && !incomplete)
+      die("read"); // readable without data, the terminal is gone
+    decode_input(false);
   }
+
+  int key = EDITOR.keys[EDITOR.key_start];
+  EDITOR.key_start = (EDITOR.key_start + 1) % EDI_KEY_QUEUE_SIZE;
+  EDITOR.key_count--;
+  PERF.keys++;
+  return key;
 }
 
 void process_keypress() {
@@ -616,6 +5403,13 @@ void process_keypress() {
     insert_new_line();
     break;
 
+  case PASTE_KEY:
+    // an empty paste leaves the buffer alone, EDITOR.paste may still be NULL
+    if (EDITOR.paste_length > 0)
+      insert_text(EDITOR.paste, EDITOR.paste_length);
+    EDITOR.paste_ready = false;
+    break;
+
   case CTRL_KEY('q'):
     if (EDITOR.file_modified && quit_times > 0) {
       set_status_message("WARNING: File has unsaved changes. "
@@ -624,6 +5418,7 @@ void process_keypress() {
       quit_times--;
       return;
     }
+    remove_autosave();
     clear_screen_for_quit();
     exit(EXIT_SUCCESS);
 
@@ -641,6 +5436,7 @@ void process_keypress() {
       EDITOR.cursor_y = EDITOR.row_offset;
     } else {
       EDITOR.cursor_y = EDITOR.row_offset + EDITOR.screen_rows - 1;
+      load_wait_rows(EDITOR.cursor_y + 1);
       if (EDITOR.cursor_y > EDITOR.number_of_rows)
         EDITOR.cursor_y = EDITOR.number_of_rows;
     }
@@ -654,7 +5450,7 @@ void process_keypress() {
     break;
   case END_KEY:
     if (EDITOR.cursor_y < EDITOR.number_of_rows) {
-      EDITOR.cursor_x = EDITOR.row[EDITOR.cursor_y].render_size;
+      EDITOR.cursor_x = row_at(EDITOR.cursor_y)->size;
     }
     break;
 
@@ -675,10 +5471,37 @@ void process_keypress() {
     editor_find();
     break;
 
+  case CTRL_KEY('g'):
+    editor_find_all();
+    break;
+
+  case CTRL_KEY('r'):
+    editor_replace_all();
+    break;
+
+  case CTRL_KEY('n'):
+  case CTRL_KEY('p'):
+    find_all_jump(key_pressed == CTRL_KEY('n') ? 1 : -1);
+    break;
+
   case CTRL_KEY('s'):
     save_file();
     break;
 
+  case CTRL_KEY('w'):
+    toggle_follow();
+    break;
+
+  case CTRL_KEY('o'):
+    toggle_perf_overlay();
+    break;
+
+  case CTRL_KEY('t'): {
+    char stats[sizeof(EDITOR.status_message)];
+    format_allocator_stats(stats, sizeof(stats));
+    set_status_message("%s", stats);
+  } break;
+
   default:
     insert_char(key_pressed);
   }
@@ -692,7 +5515,7 @@ void scroll() {
   EDITOR.render_cursor_x = 0;
   if (EDITOR.cursor_y < EDITOR.number_of_rows) {
     EDITOR.render_cursor_x =
-        cursor_x_to_render_x(&EDITOR.row[EDITOR.cursor_y], EDITOR.cursor_x);
+        cursor_x_to_render_x(row_at(EDITOR.cursor_y), EDITOR.cursor_x);
   }
   if (EDITOR.cursor_y < EDITOR.row_offset) {
     EDITOR.row_offset = EDITOR.cursor_y;
@@ -710,9 +5533,109 @@ void scroll() {
 
 void write_buffer(struct append_buffer *ab) {
   write(STDOUT_FILENO, ab->b, ab->len);
+  EDITOR.frame_bytes = ab->len;
+  EDITOR.total_bytes_written += ab->len;
   append_buffer_free(ab);
 }
 
+// forget what is on the terminal so the next frame redraws every line
+void invalidate_frame() {
+  for (int y = 0; y < EDITOR.shadow_lines; y++)
+    append_buffer_free(&EDITOR.shadow[y]);
+  free(EDITOR.shadow);
+
+  EDITOR.shadow_lines = EDITOR.screen_rows + (PERF.overlay ? 3 : 2);
+  EDITOR.shadow = malloc(sizeof(struct append_buffer) * EDITOR.shadow_lines);
+  for (int y = 0; y < EDITOR.shadow_lines; y++) {
+    EDITOR.shadow[y].b = NULL;
+    EDITOR.shadow[y].len = -1;
+  }
+  EDITOR.shadow_row_offset = EDITOR.row_offset;
+}
+
+// moves the text area by delta lines with a scroll region so only the newly
+// exposed lines have to be drawn, positive deltas scroll the text up
+void scroll_text_area(struct append_buffer *ab, int delta) {
+  int rows = EDITOR.screen_rows;
+  int distance = delta > 0 ? delta : -delta;
+  if (delta == 0 || distance >= rows)
+    return;
+
+  char buffer[32];
+  int length = snprintf(buffer, sizeof(buffer), "\x1b[1;%dr\x1b[%d%c", rows,
+                        distance, delta > 0 ? 'S' : 'T');
+  append_buffer_append(ab, buffer, length);
+  append_buffer_append(ab, "\x1b[r", 3); // reset the scroll region
+
+  struct append_buffer *shadow = EDITOR.shadow;
+  for (int y = 0; y < distance; y++)
+    append_buffer_free(&shadow[delta > 0 ? y : rows - 1 - y]);
+  if (delta > 0)
+    memmove(&shadow[0], &shadow[distance],
+            sizeof(struct append_buffer) * (rows - distance));
+  else
+    memmove(&shadow[distance], &shadow[0],
+            sizeof(struct append_buffer) * (rows - distance));
+
+  // the exposed lines are blank on the terminal now
+  for (int y = 0; y < distance; y++) {
+    struct append_buffer *exposed = &shadow[delta > 0 ? rows - 1 - y : y];
+    exposed->b = NULL;
+    exposed->len = 0;
+  }
+}
+
+// columns covered by a screen line, escape sequences take no space
+int screen_line_width(struct append_buffer *line) {
+  int width = 0;
+  for (int i = 0; i < line->len; i++) {
+    if (line->b[i] == '\x1b') {
+      while (i < line->len && !isalpha((unsigned char)line->b[i]))
+        i++;
+      continue;
+    }
+    if ((unsigned char)line->b[i] < 0x80) {
+      width++;
+      continue;
+    }
+    int codepoint;
+    i += utf8_decode(&line->b[i], line->len - i, &codepoint) - 1;
+    width += codepoint_width(codepoint);
+  }
+  return width;
+}
+
+// emits only the part of screen line y that differs from the last frame,
+// the unchanged prefix is skipped while it is plain printable ascii
+void flush_screen_line(struct append_buffer *ab, int y,
+                       struct append_buffer *line) {
+  struct append_buffer *shadow = &EDITOR.shadow[y];
+  if (shadow->len == line->len &&
+      (line->len == 0 || memcmp(shadow->b, line->b, line->len) == 0)) {
+    append_buffer_free(line);
+    return;
+  }
+
+  int prefix = 0;
+  if (shadow->len > 0 && line->len > 0 &&
+      memchr(line->b, '\x1b', line->len) == NULL) {
+    while (prefix < shadow->len && prefix < line->len &&
+           shadow->b[prefix] == line->b[prefix] && shadow->b[prefix] >= ' ' &&
+           shadow->b[prefix] <= '~')
+      prefix++;
+  }
+
+  reposition_cursor_at(ab, prefix + 1, y + 1);
+  if (line->len > prefix)
+    append_buffer_append(ab, &line->b[prefix], line->len - prefix);
+  // on a full line the cursor sits on the last cell, clearing would erase it
+  if (screen_line_width(line) < EDITOR.screen_cols)
+    append_buffer_append(ab, "\x1b[K", 3); // clear line on the right of cursor
+
+  append_buffer_free(shadow);
+  *shadow = *line;
+}
+
 void draw_welcome_message(struct append_buffer *ab) {
   char welcome_string[80];
   int welcome_length =
@@ -734,81 +5657,256 @@ void draw_welcome_message(struct append_buffer *ab) {
   append_buffer_append(ab, welcome_string, welcome_length);
 }
 
+int highlight_color(unsigned char highlight) {
+  switch (highlight) {
+  case HL_COMMENT:
+    return 36;
+  case HL_KEYWORD:
+    return 33;
+  case HL_TYPE:
+    return 32;
+  case HL_STRING:
+    return 35;
+  case HL_NUMBER:
+    return 31;
+  default:
+    return 39;
+  }
+}
+
+// appends render bytes [from, to), a color escape is only sent where the
+// highlight changes
+void append_render_bytes(struct append_buffer *ab, editor_row *row, int from,
+                         int to) {
+  if (row->render_entry == HL_UNKNOWN) {
+    append_buffer_append(ab, &row->render[from], to - from);
+    return;
+  }
+
+  unsigned char *colors = render_colors(row);
+  int color = 39;
+  while (from < to) {
+    int run = from;
+    while (run < to && colors[run] == colors[from])
+      run++;
+    int next = highlight_color(colors[from]);
+    if (next != color) {
+      char escape[16];
+      append_buffer_append(ab, escape,
+                           snprintf(escape, sizeof(escape), "\x1b[%dm", next));
+      color = next;
+    }
+    append_buffer_append(ab, &row->render[from], run - from);
+    from = run;
+  }
+  if (color != 39)
+    append_buffer_append(ab, "\x1b[39m", 5);
+}
+
+// appends the columns [start, start + width) of a current render row, wide
+// chars cut by the left edge show as blanks and by the right edge not at all
+void append_render_columns(struct append_buffer *ab, editor_row *row,
+                           int start, int width) {
+  if (row->render_ascii) {
+    int len = row->render_size - start;
+    if (len < 0)
+      len = 0;
+    if (len > width)
+      len = width;
+    append_render_bytes(ab, row, start, start + len);
+    return;
+  }
+
+  // continuing bytes have no width, so whole chars are skipped and taken
+  unsigned char *widths = render_widths(row);
+  int i = 0, column = 0;
+  while (i < row->render_size && column + widths[i] <= start)
+    column += widths[i++];
+  if (column < start && i < row->render_size) {
+    column += widths[i++];
+    while (i < row->render_size && utf8_continuation(row->render[i]))
+      i++;
+    for (int blank = start; blank < column && blank < start + width; blank++)
+      append_buffer_append(ab, " ", 1);
+  }
+
+  int end = i;
+  while (end < row->render_size &&
+         (utf8_continuation(row->render[end]) ||
+          (column < start + width && column + widths[end] <= start + width)))
+    column += widths[end++];
+  append_render_bytes(ab, row, i, end);
+}
+
 void draw_rows(struct append_buffer *ab) {
+  highlight_advance(EDITOR.row_offset + EDITOR.screen_rows);
+  row_iterator it = row_iterator_at(EDITOR.row_offset);
   for (int y = 0; y < EDITOR.screen_rows; y++) {
-    int file_row = y + EDITOR.row_offset;
-    if (file_row >= EDITOR.number_of_rows) {
+    struct append_buffer line = ABUF_INIT;
+    editor_row *row = row_iterator_next(&it);
+    if (row == NULL) {
       if (EDITOR.number_of_rows == 0 && y == EDITOR.screen_rows / 3) {
-        draw_welcome_message(ab);
+        draw_welcome_message(&line);
       } else {
-        append_buffer_append(ab, "~", 1); // add ~ to left hand side
+        append_buffer_append(&line, "~", 1); // add ~ to left hand side
       }
     } else {
-      int len = EDITOR.row[file_row].render_size - EDITOR.col_offset;
-      if (len < 0)
-        len = 0;
-      if (len > EDITOR.screen_cols)
-        len = EDITOR.screen_cols;
-      append_buffer_append(ab, &EDITOR.row[file_row].render[EDITOR.col_offset],
-                           len);
+      render_row(it.block, row);
+      it.block->render_frame = EDITOR.frame;
+      int start = row->columns ? 0 : EDITOR.col_offset; // a slice already
+      append_render_columns(&line, row, start, EDITOR.screen_cols);
     }
 
-    append_buffer_append(ab, "\x1b[K", 3); // clear line on the right of cursor
-    append_buffer_append(ab, "\r\n", 2);
+    flush_screen_line(ab, y, &line);
   }
 }
 
 void draw_status_bar(struct append_buffer *ab) {
-  append_buffer_append(ab, "\x1b[7m", 4); // invert colors
+  struct append_buffer line = ABUF_INIT;
+  append_buffer_append(&line, "\x1b[7m", 4); // invert colors
   char left_status[80], right_status[80];
 
   int left_len =
-      snprintf(left_status, sizeof(left_status), "%.20s - %d lines %s",
+      snprintf(left_status, sizeof(left_status), "%.20s - %d lines %s%s",
                EDITOR.filename ? EDITOR.filename : "[No Name]",
-               EDITOR.number_of_rows, EDITOR.file_modified ? "(modified)" : "");
-  int right_len = snprintf(right_status, sizeof(right_status), "%d/%d",
-                           EDITOR.cursor_y + 1, EDITOR.number_of_rows);
+               EDITOR.number_of_rows, EDITOR.file_modified ? "(modified)" : "",
+               FOLLOW.inotify_fd != -1 ? "(following)" : "");
+  char find_status[40];
+  int find_len = format_find_all_status(find_status, sizeof(find_status));
+  if (load_progress() < 100)
+    snprintf(&find_status[find_len], sizeof(find_status) - find_len,
+             "loading %d%% | ", load_progress());
+  int right_len = snprintf(right_status, sizeof(right_status), "%s%s%s%d/%d",
+                           find_status,
+                           EDITOR.syntax ? EDITOR.syntax->name : "",
+                           EDITOR.syntax ? " | " : "", EDITOR.cursor_y + 1,
+                           EDITOR.number_of_rows);
 
   if (left_len > EDITOR.screen_cols)
     left_len = EDITOR.screen_cols;
-  append_buffer_append(ab, left_status, left_len);
+  append_buffer_append(&line, left_status, left_len);
 
   while (left_len < EDITOR.screen_cols) {
     if (EDITOR.screen_cols - left_len == right_len) {
-      append_buffer_append(ab, right_status, right_len);
+      append_buffer_append(&line, right_status, right_len);
       break;
     } else {
-      append_buffer_append(ab, " ", 1);
+      append_buffer_append(&line, " ", 1);
       left_len++;
     }
   }
 
-  append_buffer_append(ab, "\x1b[m", 3); // normal colors
-  append_buffer_append(ab, "\r\n", 2);
+  append_buffer_append(&line, "\x1b[m", 3); // normal colors
+  flush_screen_line(ab, EDITOR.screen_rows, &line);
+}
+
+// the last frame's time in scroll, draw_rows and write_buffer, its bytes and
+// render row updates, then the reads per key and the row payload heap
+void draw_perf_overlay(struct append_buffer *ab) {
+  if (!PERF.overlay)
+    return;
+  struct append_buffer line = ABUF_INIT;
+  char overlay[160];
+  int length = snprintf(
+      overlay, sizeof(overlay),
+      "scroll %lldus draw %lldus write %lldus %dB | renders %lld | "
+      "reads/key %.2f | heap %zuK",
+      PERF.scroll_ns / 1000, PERF.draw_ns / 1000, PERF.write_ns / 1000,
+      EDITOR.frame_bytes, PERF.frame_render_updates,
+      (double)PERF.reads / (PERF.keys ? PERF.keys : 1),
+      row_payload_bytes() / 1024);
+  if (length > EDITOR.screen_cols)
+    length = EDITOR.screen_cols;
+  append_buffer_append(&line, overlay, length);
+  flush_screen_line(ab, EDITOR.screen_rows + 2, &line);
+}
+
+void toggle_perf_overlay() {
+  PERF.overlay = !PERF.overlay;
+  EDITOR.screen_rows += PERF.overlay ? -1 : 1;
+  invalidate_frame();
+}
+
+// registered at startup when EDI_PERF_LOG names a file
+void write_perf_log() {
+  FILE *log = fopen(getenv("EDI_PERF_LOG"), "w");
+  if (log == NULL)
+    return;
+  long long frames = PERF.frames ? PERF.frames : 1;
+  fprintf(log, "frames: %lld\n", PERF.frames);
+  fprintf(log, "scroll us: last %lld total %lld avg %.1f\n",
+          PERF.scroll_ns / 1000, PERF.scroll_total_ns / 1000,
+          PERF.scroll_total_ns / 1e3 / frames);
+  fprintf(log, "draw_rows us: last %lld total %lld avg %.1f\n",
+          PERF.draw_ns / 1000, PERF.draw_total_ns / 1000,
+          PERF.draw_total_ns / 1e3 / frames);
+  fprintf(log, "write_buffer us: last %lld total %lld avg %.1f\n",
+          PERF.write_ns / 1000, PERF.write_total_ns / 1000,
+          PERF.write_total_ns / 1e3 / frames);
+  fprintf(log, "bytes written: last %d total %lld\n", EDITOR.frame_bytes,
+          EDITOR.total_bytes_written);
+  fprintf(log, "keys: %lld\n", PERF.keys);
+  fprintf(log, "reads: %lld, %.2f per key\n", PERF.reads,
+          (double)PERF.reads / (PERF.keys ? PERF.keys : 1));
+  fprintf(log, "render updates: last %lld total %lld\n",
+          PERF.frame_render_updates, PERF.render_updates);
+  fprintf(log, "row payload bytes: %zu\n", row_payload_bytes());
+  fclose(log);
 }
 
 void draw_message_bar(struct append_buffer *ab) {
-  append_buffer_append(ab, "\x1b[K", 3);
+  struct append_buffer line = ABUF_INIT;
+  // the note of a prompt stays in view, the prompt gives way to it
+  char note[sizeof(EDITOR.prompt_note) + 3] = "";
+  if (EDITOR.prompt_note[0] != '\0')
+    snprintf(note, sizeof(note), " [%s]", EDITOR.prompt_note);
+  int note_length = strlen(note);
+  if (note_length > EDITOR.screen_cols)
+    note_length = EDITOR.screen_cols;
   int status_length = strlen(EDITOR.status_message);
-  if (status_length > EDITOR.screen_cols)
-    status_length = EDITOR.screen_cols;
-  if (status_length && time(NULL) - EDITOR.status_message_time < 5)
-    append_buffer_append(ab, EDITOR.status_message, status_length);
+  if (status_length > EDITOR.screen_cols - note_length)
+    status_length = EDITOR.screen_cols - note_length;
+  if (status_length &&
+      time(NULL) - EDITOR.status_message_time < EDI_MESSAGE_SECONDS)
+    append_buffer_append(&line, EDITOR.status_message, status_length);
+  append_buffer_append(&line, note, note_length);
+  flush_screen_line(ab, EDITOR.screen_rows + 1, &line);
 }
 
 void refresh_screen() {
+  EDITOR.frame++;
+  PERF.frames++;
+  long long render_updates = PERF.render_updates;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
   scroll();
+  PERF.scroll_ns = elapsed_ns(&start);
 
   struct append_buffer ab = ABUF_INIT;
-  reposition_cursor(&ab);
   hide_cursor(&ab);
+  int hidden_length = ab.len;
+  scroll_text_area(&ab, EDITOR.row_offset - EDITOR.shadow_row_offset);
+  EDITOR.shadow_row_offset = EDITOR.row_offset;
+  clock_gettime(CLOCK_MONOTONIC, &start);
   draw_rows(&ab);
+  PERF.draw_ns = elapsed_ns(&start);
+  PERF.frame_render_updates = PERF.render_updates - render_updates;
   draw_status_bar(&ab);
+  draw_perf_overlay(&ab);
   draw_message_bar(&ab);
+  if (ab.len == hidden_length)
+    ab.len = 0; // nothing changed, only the cursor moves
+  else
+    show_cursor(&ab);
   reposition_cursor_at(&ab, (EDITOR.render_cursor_x - EDITOR.col_offset) + 1,
                        (EDITOR.cursor_y - EDITOR.row_offset) + 1);
-  show_cursor(&ab);
+  clock_gettime(CLOCK_MONOTONIC, &start);
   write_buffer(&ab);
+  PERF.write_ns = elapsed_ns(&start);
+
+  PERF.scroll_total_ns += PERF.scroll_ns;
+  PERF.draw_total_ns += PERF.draw_ns;
+  PERF.write_total_ns += PERF.write_ns;
 }
 
 void set_status_message(const char *fmt, ...) {
@@ -827,29 +5925,125 @@ void init_editor() {
   EDITOR.render_cursor_x = 0;
   EDITOR.row_offset = 0;
   EDITOR.col_offset = 0;
+  EDITOR.syntax = NULL;
+  EDITOR.highlight_frontier = 0;
   EDITOR.number_of_rows = 0;
-  EDITOR.row = NULL;
+  EDITOR.rows = NULL;
+  EDITOR.render_lru_head = NULL;
+  EDITOR.render_lru_tail = NULL;
+  EDITOR.render_bytes = 0;
+  EDITOR.frame = 0;
+  EDITOR.page_lru_head = NULL;
+  EDITOR.page_lru_tail = NULL;
+  EDITOR.page_bytes = 0;
+  EDITOR.page_clock = 0;
+  EDITOR.pages_pinned = false;
+  EDITOR.file_map = NULL;
+  EDITOR.file_map_size = 0;
+  EDITOR.file_fd = -1;
   EDITOR.filename = NULL;
   EDITOR.file_modified = false;
   EDITOR.status_message[0] = '\0';
   EDITOR.status_message_time = 0;
+  EDITOR.prompt_note[0] = '\0';
+  EDITOR.input_start = 0;
+  EDITOR.input_length = 0;
+  EDITOR.key_start = 0;
+  EDITOR.key_count = 0;
+  EDITOR.paste = NULL;
+  EDITOR.paste_length = 0;
+  EDITOR.paste_capacity = 0;
+  EDITOR.pasting = false;
+  EDITOR.paste_ready = false;
+  EDITOR.autosave_deadline = 0;
+
+  update_window_size();
+
+  EDITOR.shadow = NULL;
+  EDITOR.shadow_lines = 0;
+  EDITOR.frame_bytes = 0;
+  EDITOR.total_bytes_written = 0;
+  invalidate_frame();
+}
 
-  if (get_window_size(&EDITOR.screen_rows, &EDITOR.screen_cols) == -1)
-    die("get_window_size");
-  EDITOR.screen_rows -= 2;
+// edi --replay SCRIPT FILE [ROWS COLS] runs the bytes of SCRIPT as typed
+// keys against FILE without a terminal and reports on the old stdout
+void replay(char *script, char *filename, int rows, int cols) {
+  int script_fd = open(script, O_RDONLY);
+  int sink_fd = open("/dev/null", O_WRONLY);
+  int report_fd = dup(STDOUT_FILENO);
+  if (script_fd == -1 || sink_fd == -1 || report_fd == -1)
+    die("replay");
+  dup2(script_fd, STDIN_FILENO);
+  dup2(sink_fd, STDOUT_FILENO);
+  close(script_fd);
+  close(sink_fd);
+  REPLAY.report = fdopen(report_fd, "w");
+  REPLAY.active = true;
+  REPLAY.rows = rows;
+  REPLAY.cols = cols;
+  if (getenv("EDI_PERF_LOG"))
+    atexit(write_perf_log);
+
+  init_editor();
+  init_events();
+  struct timespec open_start;
+  clock_gettime(CLOCK_MONOTONIC, &open_start);
+  open_file(filename);
+  load_finish(); // keys always meet the whole file
+  REPLAY.open_seconds = elapsed_ns(&open_start) / 1e9;
+
+  REPLAY.start_allocations = ALLOCATOR.allocations;
+  clock_gettime(CLOCK_MONOTONIC, &REPLAY.start);
+  atexit(replay_report);
+  while (true) {
+    refresh_screen();
+    process_keypress();
+  }
 }
 
 int main(int argc, char *argv[]) {
+  if (argc == 4 && strcmp(argv[1], "--bench-search") == 0) {
+    benchmark_search(argv[2], argv[3]);
+    return EXIT_SUCCESS;
+  }
+  if ((argc == 4 || argc == 6) && strcmp(argv[1], "--replay") == 0) {
+    replay(argv[2], argv[3], argc == 6 ? atoi(argv[4]) : 24,
+           argc == 6 ? atoi(argv[5]) : 80);
+    return EXIT_SUCCESS;
+  }
+
+  bool follow = argc >= 3 && strcmp(argv[1], "--follow") == 0;
+  if (getenv("EDI_PERF_LOG"))
+    atexit(write_perf_log);
   enable_raw_mode();
   init_editor();
+  init_events();
   if (argc >= 2) {
-    open_file(argv[1]);
+    open_file(argv[follow ? 2 : 1]);
   }
+  if (follow)
+    follow_start();
 
-  set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+  set_status_message("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | "
+                     "Ctrl-G = find all");
   while (true) {
     refresh_screen();
-    process_keypress();
+
+    // drain queued keys before drawing again, but keep a frame rate while a
+    // paste or key repeat keeps the queue busy
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+      process_keypress();
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000 +
+                     (now.tv_nsec - start.tv_nsec) / 1000000 <
+                 EDI_FRAME_DEADLINE_MS &&
+             input_pending());
+
+    if (EDITOR.file_modified && EDITOR.autosave_deadline == 0)
+      EDITOR.autosave_deadline = time(NULL) + EDI_AUTOSAVE_SECONDS;
   }
   disable_raw_mode();
   return EXIT_SUCCESS;